@@ -36,21 +36,314 @@
 #include <string.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/eeprom.h>
 #include <util/delay.h>
 
 #define DEBUG 0
 
+/*
+ * Select the measurement engine.
+ *
+ * 0 Timestamp edges in software. Timer 0 keeps the time; INT0 (PB2)
+ *   interrupts on each edge in slow mode and timer 1 counts events
+ *   on T1 (PA4) in fast mode.
+ * 1 Timestamp edges in hardware. Timer 1 keeps the time; timer 0
+ *   counts events on T0 (PA3) and toggles OC0A (PB2) when the
+ *   desired number of events have been counted. PB2 must be
+ *   connected to ICP1 (PA7), so that the input capture unit of
+ *   timer 1 latches the time of the last event.
+ */
+#define ENGINE_ICP 0
+
+/*
+ * In slow mode, ignore an edge on INT0 that comes less than this many
+ * microseconds after the previous one (0 accepts all edges), so that
+ * a ringing input does not end a period at each ring. Fast mode is
+ * not affected, since timer 1 counts the edges in hardware. (Only
+ * used when ENGINE_ICP is 0.)
+ */
+#define MIN_PULSE_WIDTH 0
+
+/*
+ * Set to 1 to estimate the frequency in fast mode by a least-squares
+ * fit of the times of several evenly spaced events within each
+ * measurement period, rather than from the times of the first and
+ * last event only. (See "Regression mode" below.)
+ */
+#define REGRESSION 0
+
+/*
+ * Filter the measurements before they are shown (see "Filtering"
+ * below).
+ *
+ * 0 Show each measurement.
+ * 1 (FILTER_SUM) Show the total number of events divided by the
+ *   total time of the latest measurements (a moving average).
+ * 2 (FILTER_MEDIAN) Show the median of the latest measurements.
+ */
+#define FILTER 0
+
+/*
+ * Set to 1 to add a totalizer, which counts every event on the input
+ * (see "Totalizer" below). A long press of the push button selects
+ * the next function (frequency, totalizer, statistics). If TOTAL_GATE
+ * is not 0, counting stops by itself after that many milliseconds.
+ */
+#define TOTALIZE 0
+#define TOTAL_GATE 0
+
+/*
+ * Set to 1 to add a function for measuring the high time, low time,
+ * and duty cycle of the input (see "Duty cycle" below). A short
+ * press of the push button selects which one is shown.
+ */
+#define DUTY 0
+
+/*
+ * Set to 1 to add a function for measuring the ratio between the
+ * frequencies of two independent signals, A on PA4 (T1) and B on
+ * PB2 (INT0) (see "Frequency ratio" below). Only for ENGINE_ICP 0.
+ */
+#define RATIO 0
+
+/*
+ * Set to 1 to add a function for measuring the frequency of a signal
+ * that comes in bursts, such as a keyed carrier (see "Burst mode"
+ * below). Only for ENGINE_ICP 0. The measurement window opens
+ * BURST_DELAY ms after the first edge of a burst and is BURST_WINDOW
+ * ms long; a pause of more than BURST_GAP ms in the input ends a
+ * burst. The windows of many bursts are added up into one reading.
+ */
+#define BURST 0
+#define BURST_DELAY 1
+#define BURST_WINDOW 8
+#define BURST_GAP 2
+
+/*
+ * Set to 1 to add a function for calibrating the time base against a
+ * 1PPS signal (such as from a GPS receiver) on the input (see
+ * "Calibration" below). The correction is saved in the EEPROM and
+ * applied to every frequency shown. CAL_SECONDS is the number of
+ * seconds measured for each correction.
+ */
+#define CALIBRATE 0
+#define CAL_SECONDS 64
+
+/*
+ * Select the statistics of the measured frequency to keep (see
+ * "Statistics" below). They are shown as a function selected by a
+ * long press of the push button, one page for each short press.
+ *
+ * 0 None.
+ * 1 (STATS_MOMENTS) The number of measurements, their mean, standard
+ *   deviation, minimum, and maximum.
+ * 2 (STATS_ADEV) The overlapping Allan deviation for STATS_TAUS
+ *   values of tau, which are 1, 2, 4, ... times the measurement
+ *   period.
+ * 3 Both.
+ */
+#define STATS 0
+#define STATS_TAUS 4
+
+/*
+ * Set to 1 to collect statistics about the interrupt routines, such
+ * as their longest entry latency and duration (see "Instrumentation"
+ * below). The statistics are shown as a function selected by a long
+ * press of the push button, and each short press steps to the next
+ * one.
+ */
+#define INSTRUMENT 0
+
+/*
+ * Set to 1 to send each completed measurement as a binary frame
+ * on a serial line (see "Serial output" below), at SERIAL_BAUD
+ * baud, 8 data bits, no parity, 1 stop bit. The TX pin is PA7
+ * (OC0B), or PA5 (OC1B) when ENGINE_ICP is 1.
+ */
+#define SERIAL 0
+#define SERIAL_BAUD 9600
+
+/*
+ * Set to 1 (or use "make profile") to build a version of the program
+ * for running in the simavr simulator. Each interrupt routine and
+ * the display functions write their own id to GPIOR0 while they are
+ * running (see PROF_* below), and simavr is told to write GPIOR0 and
+ * the input pins to a VCD file. The number of cycles spent in each
+ * routine can then be read from the VCD file, or printed by
+ * "make profile-run" (see sim/profile.c).
+ */
+#ifndef PROFILE
+#define PROFILE 0
+#endif
+
+#if PROFILE
+#include "avr_mcu_section.h"
+
+AVR_MCU(F_CPU, "attiny84");
+AVR_MCU_VCD_FILE("main-profile.vcd", 1000);
+
+const struct avr_mmcu_vcd_trace_t profile_trace[] _MMCU_ = {
+    { AVR_MCU_VCD_SYMBOL("PROFILE"), .what = (void*)&GPIOR0, },
+#if ENGINE_ICP
+    { AVR_MCU_VCD_SYMBOL("T0"), .mask = _BV(PA3), .what = (void*)&PINA, },
+#else
+    { AVR_MCU_VCD_SYMBOL("INT0"), .mask = _BV(PB2), .what = (void*)&PINB, },
+    { AVR_MCU_VCD_SYMBOL("T1"), .mask = _BV(PA4), .what = (void*)&PINA, },
+#endif
+};
+
+#define PROF_MAIN		1 /* main() is awake */
+#define PROF_TIME		2 /* Timer overflow interrupt */
+#define PROF_SLOW		3 /* EXT_INT0_vect */
+#define PROF_FAST		4 /* TIM1_COMPA_vect or TIM1_CAPT_vect */
+#define PROF_DOG		5 /* Sending one byte to the display */
+#define PROF_DISPLAY		6 /* display_measurement() */
+#define PROF_SHOW_LINE		7 /* show_line() */
+#define PROF_SERIAL		8 /* Serial output interrupt */
+#define PROF_DUTY		9 /* Duty cycle pin change interrupt */
+
+static inline uint8_t profile_enter(uint8_t id)
+{
+    uint8_t prev = GPIOR0;
+    GPIOR0 = id;
+    return prev;
+}
+
+static inline void profile_exit(uint8_t* prev)
+{
+    GPIOR0 = *prev;
+}
+
+/*
+ * Mark the rest of the current block (including all returns from
+ * it) as belonging to 'id'. The previous id is restored at the end,
+ * so that the routine that was interrupted gets the time after
+ * the interrupt.
+ */
+#define PROFILE_SCOPE(id)						\
+    uint8_t profile_prev __attribute__ ((cleanup(profile_exit))) =	\
+	profile_enter(id)
+#define PROFILE_MARK(id) (GPIOR0 = (id))
+#else
+#define PROFILE_SCOPE(id)
+#define PROFILE_MARK(id)
+#endif
+
 #define MAX_PERIOD 0xffffffffUL
 typedef unsigned long tick_t;
 
+/*
+ * Prescaler for the timer that counts ticks: 1, 8, or 64. A tick
+ * is TICK_PRESCALER cpu cycles. A smaller prescaler gives finer
+ * ticks, so that the same number of digits can be had from
+ * shorter measurement periods, but the timer overflow interrupt
+ * will be called more often.
+ *
+ * At prescaler 1, timer 0 wraps every 256 cycles, and an overflow is
+ * lost (and the time goes back 256 ticks) if interrupts stay disabled
+ * for longer than that. The timer 0 overflow routine takes 25 cycles
+ * and INT0 and the fast mode routine an estimated 150-250 cycles,
+ * more when the fast mode routine changes the number of events by
+ * many steps at once. The display and serial routines re-enable
+ * interrupts (or are short). The lost overflows can be counted with
+ * INSTRUMENT. (With ENGINE_ICP, timer 1 keeps the time and wraps
+ * every 65536 ticks.)
+ */
+#define TICK_PRESCALER 64
+#define TICK_HZ (F_CPU / TICK_PRESCALER)
+
+#if TICK_PRESCALER == 1
+#define TICK_CS0 _BV(CS00)
+#define TICK_CS1 _BV(CS10)
+#elif TICK_PRESCALER == 8
+#define TICK_CS0 _BV(CS01)
+#define TICK_CS1 _BV(CS11)
+#elif TICK_PRESCALER == 64
+#define TICK_CS0 (_BV(CS01) | _BV(CS00))
+#define TICK_CS1 (_BV(CS11) | _BV(CS10))
+#else
+#error "TICK_PRESCALER must be 1, 8, or 64"
+#endif
+
+/*
+ * Division factor of an external prescaler (such as a 74HC4040 or an
+ * MB506) in front of the input pins, or 1 if there is none. The
+ * counter measures the divided signal; the factor is only used when
+ * calculating the frequency to show. This is the default for the
+ * factor in the configuration, which can be changed without building
+ * a new program. A factor above 1 shows frequencies in Hz instead of
+ * dHz (so that they can go up to 999.9MHz).
+ */
+#define INPUT_PRESCALER 1
+
+/* Convert milliseconds and microseconds to ticks. */
+#define MS_TO_TICKS(ms) ((ms) * (F_CPU / 1000UL) / TICK_PRESCALER)
+#define US_TO_TICKS(us) ((us) * (F_CPU / 1000UL) / 1000 / TICK_PRESCALER)
+
 /*
  * API functions for the display. A different kind
  * of display can be used if those functions are
  * reimplemnted.
  */
 static void lcd_init(void);
-static void lcd_home(void);
+static void lcd_goto(uint8_t addr);
 static void lcd_putc(char c);
+static uint8_t lcd_room(void);
+
+/*
+ * Define the different display models.
+ *
+ * M081 1 line by 8 chars.
+ * M162 2 lines by 16 chars.
+ * M163 3 lines by 16 chars.
+ */
+
+#define DOG_LCD_M081 81
+#define DOG_LCD_M162 82
+#define DOG_LCD_M163 83
+#define DOG_MODEL DOG_LCD_M081
+
+#if DOG_MODEL == DOG_LCD_M081
+#define LCD_COLS 8
+#define LCD_LINES 1
+#elif DOG_MODEL == DOG_LCD_M162
+#define LCD_COLS 16
+#define LCD_LINES 2
+#else
+#define LCD_COLS 16
+#define LCD_LINES 3
+#endif
+
+/*
+ * The layout of the display. The frequency (or what the selected
+ * function shows) is always on the first line, line 0. On displays
+ * with more lines, each of the following is shown on the given line,
+ * or left out if it is LCD_NONE or a line that the display does not
+ * have.
+ *
+ * LINE_STATUS The measurement mode (or the name of the function), the
+ *             number of events per measurement, and the gate profile.
+ * LINE_STATS  The number of measurements and the Allan deviation (or
+ *             the relative standard deviation) from "Statistics".
+ *             Only with STATS.
+ *
+ * These lines are updated every LCD_SLOW_INTERVAL, using only the
+ * room in the display queue that is left after a full update of the
+ * first line, so they never delay the frequency.
+ */
+#define LCD_NONE 0xff
+#define LINE_STATUS 1
+#define LINE_STATS 2
+
+#define HAVE_LINE_STATUS (LINE_STATUS < LCD_LINES)
+#define HAVE_LINE_STATS (STATS && LINE_STATS < LCD_LINES)
+#define HAVE_SLOW_LINES (HAVE_LINE_STATUS || HAVE_LINE_STATS)
+
+#if LINE_STATUS == 0 || LINE_STATS == 0 || \
+    (HAVE_LINE_STATUS && HAVE_LINE_STATS && LINE_STATUS == LINE_STATS)
+#error "LINE_STATUS and LINE_STATS must be different lines, other than line 0"
+#endif
 
 /*
  * Other functions.
@@ -63,19 +356,93 @@ static inline unsigned long cli_ticks(void)
 static void init_time_keeping(void);
 static void init_event_counting(void);
 static void slow_mode(void);
+#if !ENGINE_ICP
 static void inline set_timer_cmp_reg(uint8_t log2ne)
     __attribute__ ((always_inline));
-static void display_measurement(uint8_t n, tick_t p);
+#endif
+static void display_measurement(uint8_t mode, unsigned long events,
+				tick_t p);
+static void display_bound(tick_t elapsed);
 static void show_line(char* s);
-static void display_freq(unsigned long freq);
+static void display_freq(unsigned long freq, uint8_t scale, uint8_t digits,
+			 char mark);
+static void show_text(const char* s);
+static void gate_init(void);
+static const char* gate_next(void);
+#if INSTRUMENT
+static void instr_reset(void);
+static void instr_show(uint8_t page);
+#endif
+#if TOTALIZE
+static void total_enter(void);
+static void total_exit(void);
+static void total_press(tick_t now);
+static void total_poll(tick_t now);
+static void total_show(void);
+#endif
+#if TOTALIZE || DUTY || RATIO || BURST
+static void stop_event_counting(void);
+static void restart_event_counting(void);
+#endif
+#if DUTY
+static void duty_enter(void);
+static void duty_exit(void);
+static void duty_press(void);
+static void duty_poll(tick_t now);
+static void show_time(char label, tick_t sum, uint8_t log2n);
+#endif
+#if RATIO
+static void ratio_enter(void);
+static void ratio_exit(void);
+static void ratio_poll(tick_t now);
+static inline void ratio_edge(void) __attribute__ ((always_inline));
+#endif
+#if BURST
+static void burst_enter(void);
+static void burst_exit(void);
+static void burst_poll(tick_t now);
+static inline void burst_edge(void) __attribute__ ((always_inline));
+#endif
+#if CALIBRATE
+static void cal_init(void);
+static void cal_enter(void);
+static const char* cal_press(void);
+static unsigned long cal_correct(unsigned long f);
+#endif
+#if DUTY || RATIO || CALIBRATE || STATS
+static void show_number(char label, unsigned long v, uint8_t decimals,
+			const char* suffix);
+#endif
+static void calc_init(void);
+static unsigned long mul_div(unsigned long a, unsigned long b, uint8_t s,
+			     unsigned long d);
+
+/*
+ * The settings that can be changed without building a new program.
+ * They are saved in the EEPROM (see "Configuration" below) and read
+ * into this struct once at startup; after that, the fields are used
+ * as plain variables. The layout is the same for all options.
+ */
+struct config {
+    uint8_t version;		/* CONFIG_VERSION */
+    uint8_t gate;		/* Gate profile */
+    uint8_t filter_depth;	/* Most measurements to filter */
+    uint8_t contrast;		/* Display contrast (0-63) */
+    uint16_t prescaler;		/* Division factor of the input */
+    uint32_t cal_ticks;		/* Ticks in CAL_SECONDS seconds */
+    uint8_t checksum;		/* The sum of all bytes is zero */
+};
+static struct config config;
+static void config_load(void);
+static void config_save(void);
 
 struct counter {
     /*
      * The current frequency can be calculated as:
      *
-     *     2^log2num_events / (64 * F_CPU * period)
+     *     2^log2num_events * F_CPU / (TICK_PRESCALER * period)
      *
-     * A tick is 64 cpu cycles.
+     * A tick is TICK_PRESCALER cpu cycles.
      */
     tick_t period;	/* Length of last measured period (in ticks) */
     uint8_t log2num_events;	/* log2 of number of events that occurred. */
@@ -91,568 +458,4542 @@ struct counter {
 
 static volatile struct counter slow_cnt = { MAX_PERIOD, 0, 1, 0, 0 };
 static volatile struct counter fast_cnt = { MAX_PERIOD, 0, 1, 1, 0 };
+
+/*
+ * The counter for the current mode. (When ENGINE_ICP is 1, all
+ * counting is done using fast_cnt; 'current' points to slow_cnt
+ * when every single event is timed.)
+ */
 static struct counter volatile *current;
 
+/*
+ * The fast mode watchdog is decremented every WD_INTERVAL. If
+ * no fast mode interrupts have reset it wd_top times in a row, we
+ * switch to slow mode. The interrupts come at least once per
+ * measurement period, which can be as long as gate_max (or twice
+ * that when the frequency halves), so gate_select() makes wd_top
+ * WD_TOP plus the intervals that take 2 * gate_max ticks.
+ */
 #define WD_TOP 4
+#define WD_INTERVAL MS_TO_TICKS(100)
+static volatile signed char wd_top = WD_TOP;
 static volatile signed char fast_wd = WD_TOP;
 
-int main(void)
-{
-    _delay_ms(100);		/* Wait for stable power */
-    init_time_keeping();
-    init_event_counting();
-    sei();
-    lcd_init();
+/*
+ * Completed measurements are put into a ring buffer by the
+ * interrupt routines and taken out by main(). The interrupt
+ * routines for the slow and fast modes cannot interrupt each
+ * other, so there is a single producer (only updating meas_head)
+ * and a single consumer (only updating meas_tail). Neither side
+ * needs to disable interrupts.
+ *
+ * A measurement with period MAX_PERIOD means that there is no valid
+ * measurement.
+ */
+#define MODE_SLOW 0
+#define MODE_FAST 1
+#define MODE_REGRESSION 2	/* Fast mode; period holds sum (see below) */
+#define MODE_HIGH 3		/* Period holds the total high time */
+#define MODE_RATIO 4		/* Period holds the count of A */
 
-    for (;;) {
-	uint8_t n;
-	unsigned long p;
+struct measurement {
+    uint8_t mode;		/* MODE_SLOW, MODE_FAST, ... */
+    uint8_t log2num_events;	/* log2 of number of events */
+    tick_t period;		/* Length of period (in ticks) */
+    tick_t end_ticks;		/* Time (in ticks) at end of period */
+};
 
-	_delay_ms(100);
+#define MEAS_RING_SIZE 8	/* Must be a power of two */
+static volatile struct measurement meas_ring[MEAS_RING_SIZE];
+static volatile uint8_t meas_head;
+static volatile uint8_t meas_tail;
+static volatile uint8_t meas_overruns; /* Measurements lost (ring full) */
 
-	/*
-	 * Read out information about the latest completed
-	 * measurement period.
-	 */
-	cli();
-	n = current->log2num_events;
-	p = current->period;
-	sei();
+static inline void meas_push(uint8_t mode, uint8_t n, tick_t period,
+			     tick_t end_ticks)
+    __attribute__ ((always_inline));
+static uint8_t meas_pop(struct measurement* m);
 
-#if DEBUG
-	debug_show_state(n);
+#if SERIAL
+static void serial_init(void);
+static void serial_send(struct measurement* m);
 #endif
 
-	/*
-	 * See if we should switch to slow mode.
-	 */
-	if (fast_wd-- < 0 && current == &fast_cnt) {
-	    /*
-	     * We have not got any fast mode interrupts for 400 ms.
-	     * Switch to slow mode.
-	     */
-	    fast_wd = WD_TOP;
-	    slow_mode();
-	}
-
-	/* Now display the result from the last measurement. */
-	display_measurement(n, p);
-    }
-    return 0;
-}
-
-#if DEBUG
-void debug_show_state(uint8_t n)
-{
-    int nc;
-
-    DDRA |= _BV(PA5) | _BV(PA6);
+#if FILTER
+static void filter_add(struct measurement* m);
+static void filter_show(void);
+#endif
 
-    /*
-     * Show the 2 logarithm for the number of events as a number of
-     * square wave cycles on output port PA5. (Connect an oscilloscope
-     * probe to PA5 to see it. Set the triggering mode to Normal or
-     * increase the trigger Holdoff time so that the square wave stays
-     * on the screen.)
-     */
+#if DUTY
+static void duty_show(struct measurement* high, struct measurement* p);
+#endif
+#if RATIO
+static void ratio_show(struct measurement* m);
+#endif
+#if CALIBRATE
+static void cal_add(struct measurement* m);
+static void cal_show(void);
+#endif
+#if STATS
+#define STATS_MOMENTS 1
+#define STATS_ADEV 2
+#define STATS_PAGES (1 + (STATS & STATS_MOMENTS ? 4 : 0) +		\
+		     (STATS & STATS_ADEV ? STATS_TAUS : 0))
+static void stats_reset(void);
+static void stats_add(struct measurement* m);
+static void stats_show(uint8_t page);
+#endif
+#if HAVE_SLOW_LINES
+static void show_slow_line(uint8_t row, const char* s);
+static void lcd_flush(void);
+#endif
+#if HAVE_LINE_STATUS
+static void show_status(const char* name, struct measurement* m);
+#endif
+#if HAVE_LINE_STATS
+static void stats_show_line(void);
+#endif
 
-    nc = 2 * n;
-    while (nc-- > 0) {
-	PINA |= _BV(PA5);
-	_delay_us(20);
-	if (nc % 10 == 0) {
-	    _delay_us(50);
-	}
-    }
+/*
+ * Minimum time between updates of the display.
+ */
+#define DISPLAY_INTERVAL MS_TO_TICKS(50)
 
-    /*
-     * Set PA6 high if we are in slow mode and low otherwise.
-     * (Connect a LED or logic probe to PA6 to see the mode.)
-     */
+/*
+ * With ENGINE_ICP, timer 1 keeps the time and only overflows every
+ * 210 ms, so the display queue interrupt (see DOG_vect) also wakes
+ * the main loop this often when it has nothing to send. Otherwise,
+ * the timer 0 overflow does this every 819 us (at prescaler 64).
+ */
+#define WAKE_INTERVAL MS_TO_TICKS(1)
 
-    if (current == &slow_cnt) {
-	PORTA |= _BV(PA6);
-    } else {
-	PORTA &= ~_BV(PA6);
-    }
-}
-#endif
+/*
+ * Time between updates of the other lines of the display (see
+ * LINE_STATUS).
+ */
+#define LCD_SLOW_INTERVAL MS_TO_TICKS(500)
 
 /*
- * Time keeping. We count "ticks" (1 tick = 64 cpu cycles) and only
- * convert to time when we'll need to show the frequency.
+ * How long a message (such as the name of a new gate profile) is
+ * shown before going back to the frequency.
  */
+#define MESSAGE_TIME MS_TO_TICKS(1000)
 
-static void init_time_keeping(void)
-{
-    /*
-     * Set prescaler to 64. Using a 20Mhz clock, that will give
-     * a timer tick time of appr. 3.2 us, and timer overflow appr.
-     * 819 us.
-     */
+/*
+ * In slow mode, if no edge has come for longer than the last period
+ * (plus a margin for jitter), the frequency must have dropped to at
+ * most one event per the time since the last edge. That upper bound
+ * is shown after a "<", with BOUND_DIGITS digits, until the next
+ * edge. After SLOW_TIMEOUT without an edge, "---" is shown.
+ */
+#define BOUND_MARGIN(p) ((p) / 8 + DISPLAY_INTERVAL)
+#define BOUND_DIGITS 3
+#define SLOW_TIMEOUT MS_TO_TICKS(30000UL)
 
-    TCCR0B = _BV(CS01) | _BV(CS00);
+/*
+ * A push button between PA6 and ground. (Not available when DEBUG
+ * is enabled, since DEBUG uses PA6 as an output.) It is sampled
+ * every BUTTON_INTERVAL, which is longer than the time it takes for
+ * its contacts to stop bouncing.
+ *
+ * A short press is reported when the button is released; a long press
+ * as soon as it has been held down for BUTTON_LONG_SAMPLES samples.
+ */
+#define HAVE_BUTTON (!DEBUG)
 
-    /* Enable the overflow interrupt for time 0 */
-    TIMSK0 = _BV(TOIE0);
-}
+#if HAVE_BUTTON
+#define BUTTON_BIT PA6
+#define BUTTON_INTERVAL MS_TO_TICKS(20)
+#define BUTTON_LONG_SAMPLES 50	/* 1 s */
 
-static volatile unsigned long timer0_overflow_count = 0;
+#define BUTTON_NONE 0
+#define BUTTON_SHORT 1
+#define BUTTON_LONG 2
 
-ISR(TIM0_OVF_vect)
+static void button_init(void)
 {
-    timer0_overflow_count++;
+    DDRA &= ~_BV(BUTTON_BIT);
+    PORTA |= _BV(BUTTON_BIT);	/* Pull-up */
 }
 
-/*
- * Return the number of timer ticks elapsed. Interrupts MUST
- * be disabled when calling this function.
- */
-static tick_t cli_ticks(void)
+static uint8_t button_poll(void)
 {
-    uint8_t t;
-    tick_t m;
+    static uint8_t held;	/* Number of samples held down */
+    uint8_t event = BUTTON_NONE;
 
-    m = timer0_overflow_count;
-    t = TCNT0;
-    if (TIFR0 & _BV(TOV0) && t < 255) {
-	m++;
+    if ((PINA & _BV(BUTTON_BIT)) == 0) {
+	if (held < 0xff && ++held == BUTTON_LONG_SAMPLES) {
+	    event = BUTTON_LONG;
+	}
+    } else {
+	if (held && held < BUTTON_LONG_SAMPLES) {
+	    event = BUTTON_SHORT;
+	}
+	held = 0;
     }
-    return (m << 8) | t;
+    return event;
 }
+#endif
 
-/* =====================================================================
- *
- * Count rising edges of the input signal and note their time (in ticks).
- * Output will be the number of rising edges and the time in ticks between
- * them. By dividing the number of edges by the time we get the frequency.
- *
- * We decide beforehand how many events (edges) we want to count. To
- * simplify the calculations, the number of events are the powers of
- * two: 1, 2, 3, 4, ..., 1048576. We adjust the number of events,
- * aiming for a period of at least 10000 ticks. If the period goes below
- * 10000 ticks, we'll adjust the number of events to count upwards.
- * If the number of ticks goes above 30000, we will adjust fewer
- * events next time.
- *
- * We can count events using timer 1 in CTC mode. However, it seems
- * that the minimum number of events that can be counted is 2.
- * Therefore, to react faster while counting low frequencies (less
- * than 20Hz), we use the external interrupt to count individual
- * falling edges.
- *
- * When we switch to slow mode (using the external interrupt) we
- * don't turn off timer 1. That way, we can quickly switch back to
- * fast mode.
- *
- * ====================================================================
- */
+#if (INSTRUMENT || TOTALIZE || DUTY || RATIO || BURST || CALIBRATE || \
+     STATS) && !HAVE_BUTTON
+#error "DEBUG uses PA6, which is the push button input needed by the functions"
+#endif
 
-static void init_event_counting(void)
-{
-    /*
-     * Our hardware outside the microcontroller has converted the
-     * incoming signal to a square wave and inverted it, and is
-     * feeding to both input pins PB2 (INT0) and PA4 (T1). We
-     * want to count the rising of the original signal, so since
-     * our input signal is inverted, we will need react to the
-     * FALLING edges.
-     */
+#if INSTRUMENT
+#define INSTR_PAGES 11
+#endif
 
-    /*
-     * Generate interrupts on the falling edge of the signal on PB2.
-     */
+/*
+ * The functions selected by a long press of the push button. The
+ * ones that are not enabled are FUNC_NONE.
+ */
+#define FUNC_NONE 0xff
+#define FUNC_FREQ 0
+#define FUNC_TOTAL (TOTALIZE ? 1 : FUNC_NONE)
+#define FUNC_DUTY (DUTY ? 1 + TOTALIZE : FUNC_NONE)
+#define FUNC_RATIO (RATIO ? 1 + TOTALIZE + DUTY : FUNC_NONE)
+#define FUNC_BURST (BURST ? 1 + TOTALIZE + DUTY + RATIO : FUNC_NONE)
+#define FUNC_CAL (CALIBRATE ? 1 + TOTALIZE + DUTY + RATIO + BURST : FUNC_NONE)
+#define FUNC_STATS (STATS ?						\
+		    1 + TOTALIZE + DUTY + RATIO + BURST + CALIBRATE : FUNC_NONE)
+#define FUNC_INSTR (INSTRUMENT ?					\
+		    1 + TOTALIZE + DUTY + RATIO + BURST + CALIBRATE +	\
+		    (STATS != 0) : FUNC_NONE)
+#define NUM_FUNCS (1 + TOTALIZE + DUTY + RATIO + BURST + CALIBRATE +	\
+		   (STATS != 0) + INSTRUMENT)
 
-    MCUCR = _BV(ISC01);
-    GIMSK = _BV(INT0);
+int main(void)
+{
+    tick_t wd_ticks = 0;
+    tick_t display_ticks = 0;
+#if HAVE_SLOW_LINES
+    tick_t slow_ticks = 0;
+#endif
+    struct measurement m;
+    struct measurement latest = { MODE_SLOW, 0, MAX_PERIOD, 0 };
+#if DUTY
+    struct measurement high = { MODE_HIGH, 0, 0, 0 };
+#endif
+    uint8_t update = 1;
+    tick_t message_ticks = 0;
+    uint8_t message = 0;
+#if HAVE_BUTTON
+    tick_t button_ticks = 0;
+#endif
+    uint8_t func = FUNC_FREQ;
+#if INSTRUMENT
+    uint8_t instr_page = 0;
+#endif
+#if STATS
+    uint8_t stats_page = 0;
+#endif
+#if NUM_FUNCS > 1
+    static const char func_names[NUM_FUNCS][6] = {
+	"Freq",
+#if TOTALIZE
+	"Total",
+#endif
+#if DUTY
+	"Duty",
+#endif
+#if RATIO
+	"Ratio",
+#endif
+#if BURST
+	"Burst",
+#endif
+#if CALIBRATE
+	"Cal",
+#endif
+#if STATS
+	"Stat",
+#endif
+#if INSTRUMENT
+	"Instr",
+#endif
+    };
+#endif
 
     /*
-     * Set up timer 1 in CTC mode, using the input signal on PA4 as
-     * the clock for the timer.
+     * There is no delay for the power to become stable, since the
+     * brown-out detector (see the Makefile) keeps the cpu in reset
+     * until it is.
+     */
+#if HAVE_BUTTON
+    button_init();
+#endif
+    config_load();
+    gate_init();
+#if CALIBRATE
+    cal_init();
+#endif
+    calc_init();
+    init_time_keeping();
+    init_event_counting();
+#if SERIAL
+    serial_init();
+#endif
+    sei();
+    lcd_init();
+    set_sleep_mode(SLEEP_MODE_IDLE);
+
+    for (;;) {
+	tick_t now;
+	tick_t bound = 0;
+
+	/*
+	 * Sleep until the next interrupt. We are woken up at least
+	 * every WAKE_INTERVAL with ENGINE_ICP, and by the timer 0
+	 * overflow otherwise.
+	 */
+	PROFILE_MARK(0);
+	sleep_mode();
+	PROFILE_MARK(PROF_MAIN);
+
+	/*
+	 * Take out all completed measurements. Only the latest
+	 * one will be shown, but all of them are sent on the
+	 * serial line.
+	 */
+	while (meas_pop(&m)) {
+#if SERIAL
+	    serial_send(&m);
+#endif
+#if DUTY
+	    if (m.mode == MODE_HIGH) {
+		high = m;	/* The period follows */
+		continue;
+	    }
+#endif
+#if CALIBRATE
+	    if (func == FUNC_CAL) {
+		cal_add(&m);
+	    }
+#endif
+#if STATS
+	    stats_add(&m);
+#endif
+#if FILTER
+	    filter_add(&m);
+#endif
+	    latest = m;
+	    update = 1;
+	}
+
+	/* After the measurements, so that none has ended after 'now'. */
+	cli();
+	now = cli_ticks();
+	sei();
+
+	/*
+	 * See if we should switch to slow mode.
+	 */
+	if (now - wd_ticks >= WD_INTERVAL) {
+	    wd_ticks = now;
+	    if (fast_wd-- < 0 && current == &fast_cnt) {
+		/*
+		 * We have not got any fast mode interrupts for
+		 * wd_top intervals (at least 400 ms).
+		 * Switch to slow mode.
+		 */
+		fast_wd = wd_top;
+		slow_mode();
+		latest.mode = MODE_SLOW;
+		latest.log2num_events = 0;
+		latest.period = MAX_PERIOD;
+#if FILTER
+		filter_add(&latest);
+#endif
+		update = 1;
+	    }
+	}
+
+#if HAVE_BUTTON
+	/*
+	 * A long press selects the next function. In the frequency
+	 * and burst functions, a short press selects the next gate
+	 * profile; in the totalizer, it starts, stops, and clears the
+	 * count; in the duty cycle function, it selects what is shown;
+	 * in the calibration, it saves (or clears) the correction. In
+	 * the statistics (STATS and INSTRUMENT), each short press shows
+	 * the next page of statistics. After the last one, they are
+	 * cleared and the frequency is shown again.
+	 */
+	if (now - button_ticks >= BUTTON_INTERVAL) {
+	    button_ticks = now;
+	    switch (button_poll()) {
+	    case BUTTON_SHORT:
+		switch (func) {
+#if TOTALIZE
+		case FUNC_TOTAL:
+		    total_press(now);
+		    break;
+#endif
+#if DUTY
+		case FUNC_DUTY:
+		    duty_press();
+		    break;
+#endif
+#if CALIBRATE
+		case FUNC_CAL:
+		    show_text(cal_press());
+		    message = 1;
+		    message_ticks = now;
+		    break;
+#endif
+#if STATS
+		case FUNC_STATS:
+		    if (++stats_page == STATS_PAGES) {
+			stats_page = 0;
+			stats_reset();
+			func = FUNC_FREQ;
+		    }
+		    break;
+#endif
+#if INSTRUMENT
+		case FUNC_INSTR:
+		    if (++instr_page == INSTR_PAGES) {
+			instr_page = 0;
+			instr_reset();
+			func = FUNC_FREQ;
+		    }
+		    break;
+#endif
+		default:
+		    show_text(gate_next());
+		    message = 1;
+		    message_ticks = now;
+		    break;
+		}
+		update = 1;
+		break;
+#if NUM_FUNCS > 1
+	    case BUTTON_LONG:
+#if TOTALIZE
+		if (func == FUNC_TOTAL) {
+		    total_exit();
+		}
+#endif
+#if DUTY
+		if (func == FUNC_DUTY) {
+		    duty_exit();
+		}
+#endif
+#if RATIO
+		if (func == FUNC_RATIO) {
+		    ratio_exit();
+		}
+#endif
+#if BURST
+		if (func == FUNC_BURST) {
+		    burst_exit();
+		}
+#endif
+		if (func == FUNC_TOTAL || func == FUNC_DUTY ||
+		    func == FUNC_RATIO || func == FUNC_BURST) {
+		    /* Frequency counting starts over. */
+		    latest.mode = MODE_SLOW;
+		    latest.period = MAX_PERIOD;
+#if FILTER
+		    filter_add(&latest);
+#endif
+		}
+		if (++func == NUM_FUNCS) {
+		    func = FUNC_FREQ;
+		}
+#if TOTALIZE
+		if (func == FUNC_TOTAL) {
+		    total_enter();
+		}
+#endif
+#if DUTY
+		if (func == FUNC_DUTY) {
+		    duty_enter();
+		}
+#endif
+#if RATIO
+		if (func == FUNC_RATIO) {
+		    ratio_enter();
+		}
+#endif
+#if BURST
+		if (func == FUNC_BURST) {
+		    burst_enter();
+		    /* Only the readings of the bursts are shown. */
+		    latest.mode = MODE_FAST;
+		    latest.period = MAX_PERIOD;
+#if FILTER
+		    filter_add(&latest);
+#endif
+		}
+#endif
+#if CALIBRATE
+		if (func == FUNC_CAL) {
+		    cal_enter();
+		}
+#endif
+#if STATS
+		stats_page = 0;
+#endif
+#if INSTRUMENT
+		instr_page = 0;
+#endif
+		show_text(func_names[func]);
+		message = 1;
+		message_ticks = now;
+		update = 1;
+		break;
+#endif
+	    }
+	}
+#endif
+#if TOTALIZE
+	if (func == FUNC_TOTAL) {
+	    total_poll(now);
+	}
+#endif
+#if DUTY
+	if (func == FUNC_DUTY) {
+	    duty_poll(now);
+	}
+#endif
+#if RATIO
+	if (func == FUNC_RATIO) {
+	    ratio_poll(now);
+	}
+#endif
+#if BURST
+	if (func == FUNC_BURST) {
+	    burst_poll(now);
+	}
+#endif
+	if (func != FUNC_FREQ) {
+	    update = 1;		/* Keep the count or statistics up to date */
+	}
+
+	/*
+	 * See if the next edge in slow mode is late (see BOUND_MARGIN).
+	 */
+	if (latest.mode == MODE_SLOW && latest.period != MAX_PERIOD) {
+	    tick_t elapsed = now - latest.end_ticks;
+
+	    if (elapsed > latest.period + BOUND_MARGIN(latest.period)) {
+		if (elapsed >= SLOW_TIMEOUT) {
+		    latest.period = MAX_PERIOD;
+#if FILTER
+		    filter_add(&latest);
+#endif
+		} else {
+		    bound = elapsed;
+		}
+		update = 1;
+	    }
+	}
+
+#if HAVE_SLOW_LINES
+	/*
+	 * The other lines of the display are updated less often, and
+	 * also while a message is shown on the first line.
+	 */
+	if (now - slow_ticks >= LCD_SLOW_INTERVAL) {
+	    slow_ticks = now;
+#if HAVE_LINE_STATUS
+	    {
+		const char* name = 0;
+
+#if NUM_FUNCS > 1
+		if (func != FUNC_FREQ) {
+		    name = func_names[func];
+		}
+#endif
+		show_status(name, &latest);
+	    }
+#endif
+#if HAVE_LINE_STATS
+	    stats_show_line();
+#endif
+	}
+	lcd_flush();
+#endif
+
+	/*
+	 * Leave a message on the display for a while.
+	 */
+	if (message) {
+	    if (now - message_ticks < MESSAGE_TIME) {
+		continue;
+	    }
+	    message = 0;
+	    update = 1;
+	}
+
+	/*
+	 * Only update the display if there is something new to
+	 * show, and not too often.
+	 */
+	if (!update || now - display_ticks < DISPLAY_INTERVAL) {
+	    continue;
+	}
+	display_ticks = now;
+	update = 0;
+
+#if TOTALIZE
+	if (func == FUNC_TOTAL) {
+	    total_show();
+	    continue;
+	}
+#endif
+#if DUTY
+	if (func == FUNC_DUTY) {
+	    duty_show(&high, &latest);
+	    continue;
+	}
+#endif
+#if RATIO
+	if (func == FUNC_RATIO) {
+	    ratio_show(&latest);
+	    continue;
+	}
+#endif
+#if CALIBRATE
+	if (func == FUNC_CAL) {
+	    cal_show();
+	    continue;
+	}
+#endif
+#if STATS
+	if (func == FUNC_STATS) {
+	    stats_show(stats_page);
+	    continue;
+	}
+#endif
+#if INSTRUMENT
+	if (func == FUNC_INSTR) {
+	    instr_show(instr_page);
+	    continue;
+	}
+#endif
+
+#if DEBUG
+	debug_show_state(latest.log2num_events);
+#endif
+
+	if (bound) {
+	    display_bound(bound);
+	    continue;
+	}
+
+	/* Now display the result from the last measurement. */
+#if FILTER
+	filter_show();
+#else
+	display_measurement(latest.mode, 1UL << latest.log2num_events,
+			    latest.period);
+#endif
+    }
+    return 0;
+}
+
+static void meas_push(uint8_t mode, uint8_t n, tick_t period,
+		      tick_t end_ticks)
+{
+    uint8_t head = meas_head;
+    uint8_t next = (head + 1) & (MEAS_RING_SIZE-1);
+
+    if (next == meas_tail) {
+	meas_overruns++;
+	return;
+    }
+    meas_ring[head].mode = mode;
+    meas_ring[head].log2num_events = n;
+    meas_ring[head].period = period;
+    meas_ring[head].end_ticks = end_ticks;
+    meas_head = next;
+}
+
+/*
+ * Take out the oldest measurement from the ring buffer. Return 0
+ * if the ring buffer is empty.
+ */
+static uint8_t meas_pop(struct measurement* m)
+{
+    uint8_t tail = meas_tail;
+
+    if (tail == meas_head) {
+	return 0;
+    }
+    m->mode = meas_ring[tail].mode;
+    m->log2num_events = meas_ring[tail].log2num_events;
+    m->period = meas_ring[tail].period;
+    m->end_ticks = meas_ring[tail].end_ticks;
+    meas_tail = (tail + 1) & (MEAS_RING_SIZE-1);
+    return 1;
+}
+
+#if DEBUG
+void debug_show_state(uint8_t n)
+{
+    int nc;
+
+    DDRA |= _BV(PA5) | _BV(PA6);
+
+    /*
+     * Show the 2 logarithm for the number of events as a number of
+     * square wave cycles on output port PA5. (Connect an oscilloscope
+     * probe to PA5 to see it. Set the triggering mode to Normal or
+     * increase the trigger Holdoff time so that the square wave stays
+     * on the screen.)
+     */
+
+    nc = 2 * n;
+    while (nc-- > 0) {
+	PINA |= _BV(PA5);
+	_delay_us(20);
+	if (nc % 10 == 0) {
+	    _delay_us(50);
+	}
+    }
+
+    /*
+     * Set PA6 high if we are in slow mode and low otherwise.
+     * (Connect a LED or logic probe to PA6 to see the mode.)
+     */
+
+    if (current == &slow_cnt) {
+	PORTA |= _BV(PA6);
+    } else {
+	PORTA &= ~_BV(PA6);
+    }
+}
+#endif
+
+/*
+ * Time keeping. We count "ticks" (1 tick = TICK_PRESCALER cpu cycles)
+ * and only convert to time when we'll need to show the frequency.
+ */
+
+#if !ENGINE_ICP
+
+static void init_time_keeping(void)
+{
+    /*
+     * Using a 20Mhz clock, prescaler 64 will give a timer tick time
+     * of appr. 3.2 us, and timer overflow appr. 819 us. Prescaler 8
+     * gives 0.4 us and 102 us; prescaler 1 gives 0.05 us and 12.8 us.
+     */
+
+    TCCR0B = TICK_CS0;
+
+    /* Enable the overflow interrupt for time 0 */
+    TIMSK0 = _BV(TOIE0);
+}
+
+/*
+ * The number of timer 0 overflows is kept in 24 bits. The low and
+ * middle bytes are kept in the general purpose I/O registers GPIOR1
+ * and GPIOR2, which can be read and written by the single-cycle "in"
+ * and "out" instructions, and the high byte in SRAM. Shifted left 8
+ * bits and combined with TCNT0, that is a 32-bit tick count.
+ */
+#define OVF_LOW GPIOR1
+#define OVF_MID GPIOR2
+static volatile uint8_t timer0_overflow_high;
+
+#if INSTRUMENT
+static volatile uint8_t instr_time_latency;
+#endif
+
+#if PROFILE || INSTRUMENT || !defined(__AVR__)
+
+/*
+ * In C, to make room for the PROFILE and INSTRUMENT code, and for the
+ * host build in test/.
+ */
+ISR(TIM0_OVF_vect)
+{
+    PROFILE_SCOPE(PROF_TIME);
+#if INSTRUMENT
+    /* The timer was 0 when the interrupt was requested. */
+    uint8_t late = TCNT0;
+    if (late > instr_time_latency) {
+	instr_time_latency = late;
+    }
+#endif
+    if (++OVF_LOW == 0 && ++OVF_MID == 0) {
+	timer0_overflow_high++;
+    }
+}
+
+#else
+
+/*
+ * The overflow interrupt routine only needs r24 and SREG, so it
+ * is written in assembler without the usual prologue and epilogue.
+ * It costs 25 cycles including the interrupt response (instead of
+ * about 60 for a 32-bit counter in SRAM), which is what it delays
+ * the timestamps taken by the other interrupt routines.
+ */
+ISR(TIM0_OVF_vect, ISR_NAKED)
+{
+    asm volatile("push r24\n\t"
+		 "in r24, __SREG__\n\t"
+		 "push r24\n\t"
+		 "in r24, %[low]\n\t"
+		 "inc r24\n\t"
+		 "out %[low], r24\n\t"
+		 "brne 1f\n\t"
+		 "in r24, %[mid]\n\t"
+		 "inc r24\n\t"
+		 "out %[mid], r24\n\t"
+		 "brne 1f\n\t"
+		 "lds r24, %[high]\n\t"
+		 "inc r24\n\t"
+		 "sts %[high], r24\n"
+		 "1:\n\t"
+		 "pop r24\n\t"
+		 "out __SREG__, r24\n\t"
+		 "pop r24\n\t"
+		 "reti"
+		 :
+		 : [low] "I" (_SFR_IO_ADDR(OVF_LOW)),
+		   [mid] "I" (_SFR_IO_ADDR(OVF_MID)),
+		   [high] "i" (&timer0_overflow_high));
+}
+
+#endif
+
+/*
+ * Return the number of timer ticks elapsed. Interrupts MUST
+ * be disabled when calling this function.
+ *
+ * If an overflow is pending, one is added to the overflow count and
+ * TCNT0 is read again. The overflow may have happened after TCNT0 was
+ * first read (at any prescaler, since TCNT0 counts on while the other
+ * bytes are read), but it must have happened before TIFR0 was read,
+ * so the second value always belongs after it. It takes 9 cycles, or
+ * 13 with an overflow pending.
+ */
+static tick_t cli_ticks(void)
+{
+    tick_t ticks;
+
+#ifndef __AVR__
+    /* The same in C, for the host build in test/. */
+    uint8_t t = TCNT0;
+
+    ticks = ((tick_t) timer0_overflow_high << 16) |
+	((tick_t) OVF_MID << 8) | OVF_LOW;
+    if (TIFR0 & _BV(TOV0)) {
+	t = TCNT0;
+	ticks++;
+    }
+    ticks = (ticks << 8) | t;
+#else
+    asm volatile("in %A0, %[tcnt]\n\t"
+		 "in %B0, %[low]\n\t"
+		 "in %C0, %[mid]\n\t"
+		 "lds %D0, %[high]\n\t"
+		 "in __tmp_reg__, %[tifr]\n\t"
+		 "sbrs __tmp_reg__, %[tov]\n\t"
+		 "rjmp 1f\n\t"		/* No overflow pending */
+		 "in %A0, %[tcnt]\n\t"
+		 "sec\n\t"
+		 "adc %B0, __zero_reg__\n\t"
+		 "adc %C0, __zero_reg__\n\t"
+		 "adc %D0, __zero_reg__\n"
+		 "1:"
+		 : "=d" (ticks)
+		 : [tcnt] "I" (_SFR_IO_ADDR(TCNT0)),
+		   [low] "I" (_SFR_IO_ADDR(OVF_LOW)),
+		   [mid] "I" (_SFR_IO_ADDR(OVF_MID)),
+		   [high] "i" (&timer0_overflow_high),
+		   [tifr] "I" (_SFR_IO_ADDR(TIFR0)),
+		   [tov] "I" (TOV0));
+#endif
+    return ticks;
+}
+
+#else  /* ENGINE_ICP */
+
+static void init_time_keeping(void)
+{
+    /*
+     * Run timer 1 in normal mode. Using a 20Mhz clock, prescaler 64
+     * will give a timer tick time of appr. 3.2 us, and timer overflow
+     * appr. 210 ms. Prescaler 1 gives 0.05 us and 3.3 ms.
      */
 
     TCCR1A = 0;
-    TCCR1B = _BV(WGM12) | _BV(CS12) | _BV(CS11);
-    set_timer_cmp_reg(fast_cnt.current_log2num_events);
-    TCNT1 = 0;
-    TIMSK1 = _BV(OCIE1A);
-    TIFR1 |= _BV(OCF1A);
+    TCCR1B = TICK_CS1;
+
+    /*
+     * Enable the overflow interrupt for timer 1, and the compare
+     * match A interrupt that sends bytes to the display and wakes
+     * the main loop every WAKE_INTERVAL.
+     */
+    OCR1A = WAKE_INTERVAL;
+    TIMSK1 = _BV(TOIE1) | _BV(OCIE1A);
+}
+
+static volatile uint16_t timer1_overflow_count = 0;
+
+#if INSTRUMENT
+static volatile uint8_t instr_time_latency;
+#endif
+
+ISR(TIM1_OVF_vect)
+{
+    PROFILE_SCOPE(PROF_TIME);
+#if INSTRUMENT
+    uint16_t late = TCNT1;
+    if (late > instr_time_latency) {
+	instr_time_latency = late > 0xff ? 0xff : late;
+    }
+#endif
+    timer1_overflow_count++;
+}
+
+/*
+ * Return the number of timer ticks elapsed. Interrupts MUST
+ * be disabled when calling this function.
+ *
+ * If an overflow is pending, TCNT1 is read again, for the same
+ * reason as in the cli_ticks() for timer 0 above.
+ */
+static tick_t cli_ticks(void)
+{
+    uint16_t t;
+    uint16_t m;
+
+    m = timer1_overflow_count;
+    t = TCNT1;
+    if (TIFR1 & _BV(TOV1)) {
+	t = TCNT1;
+	m++;
+    }
+    return ((tick_t) m << 16) | t;
+}
+
+#endif
+
+#if INSTRUMENT
+
+/* =====================================================================
+ *
+ * Instrumentation.
+ *
+ * The interrupt routines for the slow and fast modes and for the
+ * display note how long they run (in ticks) and how late they were
+ * called. A ratio of the input frequency and the tick frequency where
+ * the latencies or durations grow large is where the interrupt load
+ * starts to make the timestamps unreliable.
+ *
+ * The latency is the best estimate available for each routine:
+ *
+ * EXT_INT0_vect   How much longer the period was than the previous
+ *                 one (in ticks). For a stable input, this is the
+ *                 variation of the latency.
+ * TIM1_COMPA_vect The number of input events counted by timer 1 since
+ *                 the compare match.
+ * TIM1_CAPT_vect  The number of ticks since the event was captured.
+ * Timer overflow  The number of ticks since the overflow.
+ *
+ * An overflow of the timer for the ticks is lost if it happens while
+ * the previous overflow is still waiting for its interrupt routine
+ * to be called. That is detected at the end of each instrumented
+ * routine.
+ *
+ * ====================================================================
+ */
+
+#if ENGINE_ICP
+#define INSTR_TCNT TCNT1
+#define INSTR_TIFR TIFR1
+#define INSTR_TOV TOV1
+#define INSTR_OVF_COUNT ((uint8_t) timer1_overflow_count)
+typedef uint16_t instr_time_t;
+#else
+#define INSTR_TCNT TCNT0
+#define INSTR_TIFR TIFR0
+#define INSTR_TOV TOV0
+#define INSTR_OVF_COUNT OVF_LOW
+typedef uint8_t instr_time_t;
+#endif
+
+struct isr_stats {
+    uint8_t latency;		/* Longest latency (see above) */
+    uint8_t duration;		/* Longest time spent in the routine */
+};
+
+static volatile struct isr_stats instr_slow;
+static volatile struct isr_stats instr_fast;
+static volatile struct isr_stats instr_dog;
+static volatile uint8_t instr_depth;	/* Number of routines running */
+static volatile uint8_t instr_max_depth;
+static volatile uint8_t instr_max_pending; /* Interrupts waiting at once */
+static volatile uint16_t instr_lost_ovf;  /* Lost timer overflows */
+static volatile uint16_t instr_emergency; /* Emergency switches */
+
+static inline uint8_t instr_sat(unsigned long v)
+{
+    return v > 0xff ? 0xff : v;
+}
+
+static inline void instr_late(volatile struct isr_stats* s, unsigned long v)
+{
+    uint8_t late = instr_sat(v);
+
+    if (late > s->latency) {
+	s->latency = late;
+    }
+}
+
+/*
+ * Return the number of enabled interrupts that are waiting to be
+ * served. (The flag bits have the same positions as the enable
+ * bits.)
+ */
+static uint8_t instr_pending(void)
+{
+    uint8_t n = 0;
+    uint8_t f;
+
+    for (f = TIFR0 & TIMSK0; f; f &= f - 1) {
+	n++;
+    }
+    for (f = TIFR1 & TIMSK1; f; f &= f - 1) {
+	n++;
+    }
+    for (f = GIFR & GIMSK; f; f &= f - 1) {
+	n++;
+    }
+    return n;
+}
+
+struct instr_scope {
+    volatile struct isr_stats* stats;
+    instr_time_t start;
+    uint8_t ovf_count;		/* Overflow count at the start */
+    uint8_t tov;		/* Overflow pending at the start */
+};
+
+static inline struct instr_scope instr_enter(volatile struct isr_stats* s)
+{
+    struct instr_scope sc;
+    uint8_t pending;
+
+    sc.start = INSTR_TCNT;
+    sc.stats = s;
+    sc.ovf_count = INSTR_OVF_COUNT;
+    sc.tov = INSTR_TIFR & _BV(INSTR_TOV);
+    if (++instr_depth > instr_max_depth) {
+	instr_max_depth = instr_depth;
+    }
+    pending = instr_pending();
+    if (pending > instr_max_pending) {
+	instr_max_pending = pending;
+    }
+    return sc;
+}
+
+static inline void instr_exit(struct instr_scope* sc)
+{
+    instr_time_t now = INSTR_TCNT;
+    uint8_t d = instr_sat((instr_time_t) (now - sc->start));
+
+    if (d > sc->stats->duration) {
+	sc->stats->duration = d;
+    }
+
+    /*
+     * If an overflow was already pending at the start, no overflow
+     * interrupt has run since, and the timer has wrapped around
+     * once more, the first overflow has been lost.
+     */
+    if (sc->tov && sc->ovf_count == INSTR_OVF_COUNT &&
+	(INSTR_TIFR & _BV(INSTR_TOV)) && now < sc->start) {
+	instr_lost_ovf++;
+    }
+    instr_depth--;
+}
+
+/*
+ * Collect statistics for the rest of the current block into 's'.
+ */
+#define INSTR_SCOPE(s)							\
+    struct instr_scope instr_sc __attribute__ ((cleanup(instr_exit))) = \
+	instr_enter(&(s))
+#define INSTR_LATE(s, v) instr_late(&(s), (v))
+#define INSTR_COUNT(c) ((c)++)
+
+static void instr_reset(void)
+{
+    cli();
+    memset((void *) &instr_slow, 0, sizeof(instr_slow));
+    memset((void *) &instr_fast, 0, sizeof(instr_fast));
+    memset((void *) &instr_dog, 0, sizeof(instr_dog));
+    instr_time_latency = 0;
+    instr_max_depth = 0;
+    instr_max_pending = 0;
+    instr_lost_ovf = 0;
+    instr_emergency = 0;
+    meas_overruns = 0;
+    sei();
+}
+
+#else
+#define INSTR_SCOPE(s)
+#define INSTR_LATE(s, v)
+#define INSTR_COUNT(c)
+#endif
+
+/*
+ * Desired minimum number of ticks for the normal gate profile. This
+ * determines the number of significant digits, so it does not depend
+ * on TICK_PRESCALER.
+ */
+#define MIN_PERIOD 10000UL
+
+/*
+ * Gate profiles. The number of events (at most 2^max_log2ne) is
+ * adjusted so that each period is from min_period to 3*min_period
+ * ticks long. A longer period gives more digits. The number of
+ * events can be up to 2^24 (see set_timer_cmp_reg()).
+ *
+ * At prescaler 64, the periods are appr. 8 ms, 32 ms, and 1 s.
+ */
+static const struct {
+    char name[7];
+    tick_t min_period;
+    uint8_t max_log2ne;
+} gates[] = {
+    {"Fast",   MIN_PERIOD / 4,  20},
+    {"Normal", MIN_PERIOD,      20},
+    {"HiRes",  MIN_PERIOD * 32, 24},
+};
+#define NUM_GATES ((uint8_t) (sizeof(gates) / sizeof(gates[0])))
+#define GATE_DEFAULT 1
+
+/*
+ * The current gate profile. Only changed by gate_next() with
+ * interrupts disabled.
+ */
+static uint8_t gate;
+static volatile tick_t gate_min = MIN_PERIOD;
+static volatile tick_t gate_max = MIN_PERIOD * 3;
+static volatile uint8_t gate_max_log2ne = 20;
+
+static void gate_select(uint8_t g)
+{
+    tick_t wd = gates[g].min_period * 3 * 2 / WD_INTERVAL;
+
+    if (wd > 127 - WD_TOP) {
+	wd = 127 - WD_TOP;
+    }
+    cli();
+    gate = g;
+    gate_min = gates[g].min_period;
+    gate_max = gates[g].min_period * 3;
+    gate_max_log2ne = gates[g].max_log2ne;
+    wd_top = WD_TOP + wd;
+    fast_wd = wd_top;
+    sei();
+}
+
+/*
+ * Select the saved gate profile.
+ */
+static void gate_init(void)
+{
+    gate_select(config.gate);
+}
+
+/*
+ * Select and save the next gate profile. Return its name.
+ */
+static const char* gate_next(void)
+{
+    gate_select(gate + 1 < NUM_GATES ? gate + 1 : 0);
+    config.gate = gate;
+    config_save();
+    return gates[gate].name;
+}
+
+/*
+ * A period that is much shorter than gate_min means that the
+ * frequency has risen since the number of events was chosen. Such
+ * a measurement has fewer digits than usual and is not published;
+ * the next one, with the number of events adjusted, will be.
+ */
+#define MIN_PUBLISH_PERIOD (gate_min / 2)
+
+/*
+ * Return the 2 logarithm of the number of events needed for a
+ * period of at least gate_min ticks, given that 2^log2ne events
+ * took 'period' ticks.
+ */
+static inline uint8_t predict_log2ne(uint8_t log2ne, tick_t period)
+{
+    if (period == 0) {
+	period = 1;
+    }
+    while (period < gate_min && log2ne < gate_max_log2ne) {
+	log2ne++;
+	period *= 2;
+    }
+    return log2ne;
+}
+
+/*
+ * The periods at which we switch between slow and fast mode. They
+ * are times rather than a number of ticks, so that the switches
+ * happen at the same frequencies (appr. 31Hz and 21Hz) regardless
+ * of TICK_PRESCALER. (At prescaler 64 they are MIN_PERIOD and
+ * MIN_PERIOD*3.)
+ *
+ * We switch back to slow mode only when an event takes
+ * SWITCH_HYSTERESIS/2 times as long as when we switched to fast
+ * mode, so that an input frequency close to either of them will not
+ * make the counter switch back and forth.
+ */
+#define SWITCH_HYSTERESIS 3
+#define FAST_SWITCH_PERIOD MS_TO_TICKS(32)	/* One event */
+#define SLOW_SWITCH_PERIOD (FAST_SWITCH_PERIOD * SWITCH_HYSTERESIS) /* Two events */
+
+/*
+ * Do an emergency switch to fast mode if a single period in slow mode
+ * is shorter than this.
+ */
+#define EMERGENCY_PERIOD US_TO_TICKS(320)
+
+/*
+ * Also switch to fast mode if more than 2^STORM_LOG2_EDGES edges
+ * (2^STORM_LOG2_EDGES periods) arrive on INT0 within STORM_WINDOW,
+ * counting the edges ignored because of MIN_PULSE_WIDTH. That limits
+ * the rate of external interrupts even when no single period is
+ * shorter than EMERGENCY_PERIOD. The average period is then the
+ * same as for an emergency switch.
+ */
+#define STORM_LOG2_EDGES 3
+#define STORM_WINDOW (EMERGENCY_PERIOD << STORM_LOG2_EDGES)
+
+#if REGRESSION
+
+/* =====================================================================
+ *
+ * Regression mode.
+ *
+ * Each measurement period of 2^n events is divided into M = 2^m
+ * sub-periods of 2^(n-m) events each, and the time t(i) of the end
+ * of each sub-period is taken (t(0) = 0 being the start of the
+ * period). Fitting a straight line to the M+1 points (i, t(i)) gives
+ * a better estimate of the time per event than t(M) alone, since the
+ * timing errors of the individual points are averaged out.
+ *
+ * Using x(i) = 2i - M (so that the sum of all x(i) is zero), the
+ * least-squares estimate of the length of the whole period is:
+ *
+ *    P = M * 2 * Sxt / Sxx = 6 * Sxt / ((M+1) * (M+2))
+ *
+ * where Sxt is the sum of x(i)*t(i), and Sxx = M(M+1)(M+2)/3 is
+ * the sum of x(i)^2. To avoid multiplications in the interrupt
+ * routine, we only accumulate St (the sum of t(i)) and U (the sum
+ * of all partial sums of t(i)). Since U = (M+1)*St - sum(i*t(i)):
+ *
+ *    Sxt = (M+2) * St - 2 * U
+ *
+ * Sxt is published in place of the period, with mode set to
+ * MODE_REGRESSION. The frequency in events per tick is
+ * 2^n * REG_GAIN / Sxt, where REG_GAIN = (M+1)(M+2)/6 (which is
+ * always an integer when M is a power of two).
+ *
+ * The regression is only used when there are at least two events in
+ * each sub-period (n > m).
+ *
+ * ====================================================================
+ */
+
+#define REG_LOG2_SAMPLES 4
+#define REG_SAMPLES (1 << REG_LOG2_SAMPLES)
+#define REG_GAIN ((REG_SAMPLES+1UL) * (REG_SAMPLES+2) / 6)
+
+static uint8_t reg_i;		/* Number of sub-periods so far */
+static tick_t reg_st;		/* Sum of t(i) */
+static tick_t reg_u;		/* Sum of partial sums of t(i) */
+static tick_t reg_sxt;		/* Result for the last period */
+
+static inline uint8_t reg_active(uint8_t log2ne)
+{
+    return log2ne > REG_LOG2_SAMPLES;
+}
+
+static inline void reg_start(void)
+{
+    reg_i = 0;
+    reg_st = 0;
+    reg_u = 0;
+}
+
+/*
+ * Add the time (relative to the start of the period) at the end of
+ * a sub-period. Return 1 if the last sub-period has ended, with
+ * the result in reg_sxt.
+ */
+static inline uint8_t reg_sample(tick_t t)
+{
+    reg_st += t;
+    reg_u += reg_st;
+    if (++reg_i < REG_SAMPLES) {
+	return 0;
+    }
+    reg_sxt = (REG_SAMPLES+2) * reg_st - 2 * reg_u;
+    reg_start();
+    return 1;
+}
+
+#endif
+
+#if !ENGINE_ICP
+
+/* =====================================================================
+ *
+ * Count rising edges of the input signal and note their time (in ticks).
+ * Output will be the number of rising edges and the time in ticks between
+ * them. By dividing the number of edges by the time we get the frequency.
+ *
+ * We decide beforehand how many events (edges) we want to count. To
+ * simplify the calculations, the number of events are the powers of
+ * two: 1, 2, 3, 4, ..., 1048576. We adjust the number of events,
+ * aiming for a period of at least 10000 ticks. If the period goes below
+ * 10000 ticks, we'll adjust the number of events to count upwards.
+ * If the number of ticks goes above 30000, we will adjust fewer
+ * events next time. (Those are the numbers for the normal gate
+ * profile; see gates[] above.)
+ *
+ * We can count events using timer 1 in CTC mode. However, it seems
+ * that the minimum number of events that can be counted is 2.
+ * Therefore, to react faster while counting low frequencies (less
+ * than 20Hz), we use the external interrupt to count individual
+ * falling edges.
+ *
+ * When we switch to slow mode (using the external interrupt) we
+ * don't turn off timer 1. That way, we can quickly switch back to
+ * fast mode.
+ *
+ * ====================================================================
+ */
+
+static volatile uint8_t counter_high;
+static volatile uint8_t cmp_high;
+
+static void init_event_counting(void)
+{
+    /*
+     * Our hardware outside the microcontroller has converted the
+     * incoming signal to a square wave and inverted it, and is
+     * feeding to both input pins PB2 (INT0) and PA4 (T1). We
+     * want to count the rising of the original signal, so since
+     * our input signal is inverted, we will need react to the
+     * FALLING edges.
+     */
+
+    /*
+     * Generate interrupts on the falling edge of the signal on PB2.
+     */
+
+    MCUCR = _BV(ISC01);
+    GIMSK = _BV(INT0);
+
+    /*
+     * Set up timer 1 in CTC mode, using the input signal on PA4 as
+     * the clock for the timer.
+     */
+
+    TCCR1A = 0;
+    TCCR1B = _BV(WGM12) | _BV(CS12) | _BV(CS11);
+    set_timer_cmp_reg(fast_cnt.current_log2num_events);
+    TCNT1 = 0;
+    TIMSK1 = _BV(OCIE1A);
+    TIFR1 |= _BV(OCF1A);
+
+    /*
+     * Start up in slow mode. The interrupt handler for slow
+     * mode will shift to fast mode if the frequency is too high.
+     */
+
+    current = &slow_cnt;
+}
+
+/*
+ * Switch to fast mode from the interrupt routine for the slow mode,
+ * counting 2^log2ne events in each period. We can't relate the time
+ * of the edge to the count in timer 1, so the first period after the
+ * switch only starts the measurement.
+ */
+static inline void fast_mode(uint8_t log2ne, tick_t ticks)
+{
+    /*
+     * Fast mode counts at least two events, like slow_mode() sets up.
+     * A single period can be longer than gate_min at prescaler 1,
+     * which would give 0 here (and OCR1A = 0).
+     */
+    if (log2ne == 0) {
+	log2ne = 1;
+    }
+    GIMSK = 0;
+    fast_cnt.period = MAX_PERIOD;
+    fast_cnt.first_time = 1;
+    fast_cnt.current_log2num_events = log2ne;
+    fast_cnt.prev_ticks = ticks;
+    set_timer_cmp_reg(log2ne);
+    counter_high = 0;
+    TCNT1 = 0;
+    current = &fast_cnt;
+}
+
+static tick_t storm_start;	/* Start of storm window */
+static uint8_t storm_edges;	/* Edges in window after the first */
+
+/*
+ * The external interrupt has a higher priority than the timer
+ * overflow interrupt. A storm of edges on INT0 could therefore keep
+ * the overflow interrupt from running for more than a full lap of
+ * timer 0. One overflow would then be lost, and every period that
+ * spans it would be 256 ticks too short.
+ *
+ * While the overflow interrupt is kept waiting, cli_ticks() adds
+ * the pending overflow, but when the timer wraps around again, the
+ * time goes back by 256 ticks. If the time of an edge is up to a lap
+ * before the time of the previous edge, both modes start over, so
+ * that no period spanning the lost overflow is published, and an
+ * invalid measurement is published so that "---" is shown until the
+ * next valid one.
+ */
+static tick_t int0_ticks;	/* Time of the previous edge */
+
+#if RATIO
+static volatile uint8_t ratio_on;
+#endif
+#if BURST
+static volatile uint8_t burst_on;
+#endif
+
+/*
+ * Interrupt service routine for the slow counting mode.
+ */
+ISR(EXT_INT0_vect)
+{
+#if RATIO
+    if (ratio_on) {
+	ratio_edge();
+	return;
+    }
+#endif
+#if BURST
+    if (burst_on) {
+	burst_edge();
+	return;
+    }
+#endif
+    PROFILE_SCOPE(PROF_SLOW);
+    tick_t cs = cli_ticks();
+    INSTR_SCOPE(instr_slow);
+
+    if ((tick_t) (int0_ticks - cs - 1) < 255) {
+	slow_cnt.first_time = 1;
+	fast_cnt.first_time = 1;
+	meas_push(MODE_SLOW, 0, MAX_PERIOD, cs);
+    }
+    int0_ticks = cs;
+
+    if (cs - storm_start > STORM_WINDOW) {
+	storm_start = cs;
+	storm_edges = 0;
+    } else if (++storm_edges == 1 << STORM_LOG2_EDGES) {
+	INSTR_COUNT(instr_emergency);
+	fast_mode(predict_log2ne(STORM_LOG2_EDGES, cs - storm_start), cs);
+	return;
+    }
+
+#if MIN_PULSE_WIDTH
+    if (!slow_cnt.first_time &&
+	cs - slow_cnt.prev_ticks < US_TO_TICKS(MIN_PULSE_WIDTH)) {
+	return;			/* Ringing */
+    }
+#endif
+
+    if (slow_cnt.first_time) {
+	/* We can't calculate a period because it's the first time. */
+	slow_cnt.first_time = 0;
+	slow_cnt.prev_ticks = cs;
+    } else {
+	/*
+	 * Calculate the length of period that just ended. We don't need
+	 * to update log2num_events since it is always 0 (= one event).
+	 */
+	tick_t period = cs - slow_cnt.prev_ticks;
+	INSTR_LATE(instr_slow, period > slow_cnt.period ?
+		   period - slow_cnt.period : 0);
+	slow_cnt.period = period;
+	slow_cnt.prev_ticks = cs;
+	meas_push(MODE_SLOW, 0, period, cs);
+
+	/*
+	 * If the period is less than 320 us, do an emergency switch
+	 * to fast counter mode. This is normally handled by the
+	 * interrupt routine for the fast mode, but if the frequency
+	 * rises quickly it might not react sufficiently quickly. Note
+	 * that the external pin interrupt has a higher priority then
+	 * any of the timer interrupts, so if the incoming frequency is
+	 * too high no other interrupt routine than the external
+	 * interrupt will ever be called.
+	 */
+	if (period < EMERGENCY_PERIOD) {
+	    /*
+	     * Use the period to choose the number of events, so that
+	     * the first measurement in fast mode has all digits.
+	     */
+	    INSTR_COUNT(instr_emergency);
+	    fast_mode(predict_log2ne(0, period), cs);
+	}
+    }
+}
+
+/*
+ * Force switch to slow mode. Reinitialize the fast mode
+ * counter to count two events.
+ *
+ * If no event at all has been counted since the end of the last
+ * fast mode period (timer 1 stays at TOP until the next event), the
+ * next event will end a period that started at fast_cnt.prev_ticks,
+ * so both modes can continue timing from there.
+ */
+static void slow_mode(void)
+{
+    uint8_t chain;
+
+    cli();
+    chain = !fast_cnt.first_time && counter_high == 0 && TCNT1 == OCR1A;
+#if REGRESSION
+    chain = chain && reg_i == 0;
+#endif
+    GIFR = _BV(INTF0);		/* Forget any old edge */
+    GIMSK = _BV(INT0);
+    slow_cnt.first_time = !chain;
+    slow_cnt.prev_ticks = fast_cnt.prev_ticks;
+    slow_cnt.period = MAX_PERIOD;
+    current = &slow_cnt;
+    fast_cnt.first_time = !chain;
+    fast_cnt.current_log2num_events = 1;
+    set_timer_cmp_reg(fast_cnt.current_log2num_events);
+    counter_high = 0;
+
+    /*
+     * When chaining, wrap around to 0 at the next event, so that
+     * the compare match will be at the second event.
+     */
+    TCNT1 = chain ? 0xffff : 0;
+    sei();
+}
+
+static void inline set_timer_cmp_reg(uint8_t log2ne)
+{
+#if REGRESSION
+    /*
+     * Interrupt at the end of each sub-period.
+     */
+    reg_start();
+    if (reg_active(log2ne)) {
+	log2ne -= REG_LOG2_SAMPLES;
+    }
+#endif
+    if (log2ne <= 16) {
+	/*
+	 * Set up the counter from 2 up to 2^16 events.
+	 */
+	OCR1A = (1UL << log2ne) - 1;
+	cmp_high = 0;
+    } else {
+	/*
+	 * Set up our extended counter to count more than
+	 * 2^16 events.
+	 */
+	OCR1A = 0xffff;
+	cmp_high = (1 << (log2ne-16)) - 1;
+	counter_high = 0;
+    }
+}
+
+/*
+ * Interrupt service routine for the fast counting mode.
+ */
+ISR(TIM1_COMPA_vect)
+{
+    PROFILE_SCOPE(PROF_FAST);
+    tick_t ticks = cli_ticks();
+    INSTR_SCOPE(instr_fast);
+    INSTR_LATE(instr_fast, TCNT1); /* Events since the match */
+
+    fast_wd = wd_top;
+
+    if (counter_high++ != cmp_high) {
+	/*
+	 * Counter set up to count more than 2^16 events
+	 * (for high frequencies).
+	 */
+	return;
+    }
+    counter_high = 0;
+
+    if (fast_cnt.first_time) {
+	/*
+	 * The very first time. We can't calculate a period.
+	 */
+	fast_cnt.first_time = 0;
+	fast_cnt.prev_ticks = ticks;
+#if REGRESSION
+	reg_start();
+#endif
+	return;
+    }
+
+#if REGRESSION
+    if (reg_active(fast_cnt.current_log2num_events) &&
+	!reg_sample(ticks - fast_cnt.prev_ticks)) {
+	return;			/* Not the last sub-period */
+    }
+#endif
+
+    /*
+     * Calculate the result for the period that was just finished.
+     */
+    uint8_t log2ne = fast_cnt.current_log2num_events;
+    fast_cnt.log2num_events = log2ne;
+    tick_t period = fast_cnt.period = ticks - fast_cnt.prev_ticks;
+    fast_cnt.prev_ticks = ticks;
+    uint8_t was_fast = current == &fast_cnt;
+
+    /*
+     * Now see if we should adjust the number of events we are counting
+     * for each period.
+     */
+
+    if (period < gate_min && log2ne < gate_max_log2ne) {
+	/*
+	 * Too short period. Count more events next time.
+	 */
+	do {
+	    log2ne++;
+	    period *= 2;
+	} while (period < gate_min && log2ne < gate_max_log2ne);
+	set_timer_cmp_reg(log2ne);
+	GIMSK = 0;
+	current = &fast_cnt;
+	fast_cnt.current_log2num_events = log2ne;
+    } else if (period > gate_max && log2ne > 1) {
+	/*
+	 * Too long period. Count fewer events next time.
+	 */
+	do {
+	    log2ne--;
+	    period /= 2;
+	} while (period > gate_max && log2ne > 1);
+	set_timer_cmp_reg(log2ne);
+	fast_cnt.current_log2num_events = log2ne;
+    }
+
+    /*
+     * Check if we should change mode.
+     */
+
+    if (current == &fast_cnt) {
+	if (period > SLOW_SWITCH_PERIOD && log2ne == 1) {
+	    /*
+	     * Too long period. Switch to slow mode. The event that
+	     * ended this period starts the first period in slow
+	     * mode. It has already set the external interrupt flag,
+	     * so clear it first.
+	     */
+	    GIFR = _BV(INTF0);
+	    GIMSK = _BV(INT0);
+	    slow_cnt.period = period / 2;
+	    slow_cnt.prev_ticks = ticks;
+	    slow_cnt.first_time = 0;
+	    current = &slow_cnt;
+	}
+    } else if (slow_cnt.period < FAST_SWITCH_PERIOD) {
+	/*
+	 * Running too fast for slow mode. Switch to fast mode.
+	 */
+	GIMSK = 0;
+	current = &fast_cnt;
+    }
+
+    /*
+     * Publish the measurement if it was made in fast mode or
+     * we just switched to fast mode, unless it was too short.
+     */
+    if (fast_cnt.period < MIN_PUBLISH_PERIOD &&
+	fast_cnt.log2num_events < gate_max_log2ne) {
+	return;
+    }
+    if (was_fast || current == &fast_cnt) {
+#if REGRESSION
+	if (reg_active(fast_cnt.log2num_events)) {
+	    meas_push(MODE_REGRESSION, fast_cnt.log2num_events,
+		      reg_sxt, ticks);
+	    return;
+	}
+#endif
+	meas_push(MODE_FAST, fast_cnt.log2num_events, fast_cnt.period, ticks);
+    }
+}
+
+#else  /* ENGINE_ICP */
+
+/* =====================================================================
+ *
+ * Count events using timer 0 and timestamp them using the input
+ * capture unit of timer 1.
+ *
+ * Timer 0 is clocked by the input signal on T0 (PA3) and runs in CTC
+ * mode, toggling OC0A (PB2) each time 2^n events have been counted.
+ * OC0A is connected to ICP1 (PA7), so timer 1 latches the time of the
+ * 2^n:th event in ICR1. The time of the event therefore does not
+ * depend on how long it takes before the interrupt routine is
+ * called.
+ *
+ * Since the time is captured in hardware even for single events,
+ * there is no separate slow mode. The number of events is adjusted
+ * from 2^0 up to 2^max_log2ne in the same way as for timer 1 in the
+ * software engine (see above). Counting 2^0 events corresponds to
+ * slow mode.
+ *
+ * ====================================================================
+ */
+
+static volatile uint16_t counter_high;
+static volatile uint16_t cmp_high;
+
+static void set_event_cmp_reg(uint8_t log2ne)
+{
+#if REGRESSION
+    reg_start();
+    if (reg_active(log2ne)) {
+	log2ne -= REG_LOG2_SAMPLES;
+    }
+#endif
+    if (log2ne <= 8) {
+	OCR0A = (1 << log2ne) - 1;
+	cmp_high = 0;
+    } else {
+	OCR0A = 0xff;
+	cmp_high = (1UL << (log2ne-8)) - 1;
+    }
+    counter_high = 0;
+
+    /*
+     * If more events than the new number have already been counted,
+     * timer 0 would have to wrap around before the next match. Start
+     * over instead.
+     */
+    if (TCNT0 > OCR0A) {
+	TCNT0 = 0;
+	fast_cnt.first_time = 1;
+    }
+}
+
+/*
+ * Capture the next change of OC0A.
+ */
+static inline void set_capture_edge(void)
+{
+    if (PINB & _BV(PB2)) {
+	TCCR1B &= ~_BV(ICES1);
+    } else {
+	TCCR1B |= _BV(ICES1);
+    }
+    TIFR1 = _BV(ICF1);
+}
+
+static void init_event_counting(void)
+{
+    /*
+     * Count the falling edges on T0 in CTC mode, toggling OC0A on
+     * each compare match.
+     */
+    DDRB |= _BV(PB2);
+    TCCR0A = _BV(COM0A0) | _BV(WGM01);
+    TCCR0B = _BV(CS02) | _BV(CS01);
+    fast_cnt.current_log2num_events = 0;
+    set_event_cmp_reg(0);
+    TCNT0 = 0;
+
+    set_capture_edge();
+    TIMSK1 |= _BV(ICIE1);
+
+    current = &slow_cnt;
+}
+
+/*
+ * Force switch to timing single events.
+ */
+static void slow_mode(void)
+{
+    cli();
+    fast_cnt.first_time = 1;
+    fast_cnt.current_log2num_events = 0;
+    set_event_cmp_reg(0);
+    current = &slow_cnt;
+    sei();
+}
+
+ISR(TIM1_CAPT_vect)
+{
+    PROFILE_SCOPE(PROF_FAST);
+    uint16_t c = ICR1;
+    uint16_t m = timer1_overflow_count;
+    tick_t ticks;
+
+    /*
+     * If the timer overflowed before the capture but the overflow
+     * interrupt has not run yet, the captured value is small.
+     */
+    if (TIFR1 & _BV(TOV1) && c < 0x8000) {
+	m++;
+    }
+    ticks = ((tick_t) m << 16) | c;
+    set_capture_edge();
+    INSTR_SCOPE(instr_fast);
+    INSTR_LATE(instr_fast, (uint16_t) (TCNT1 - c));
+
+    fast_wd = wd_top;
+
+    if (counter_high++ != cmp_high) {
+	return;
+    }
+    counter_high = 0;
+
+    if (fast_cnt.first_time) {
+	fast_cnt.first_time = 0;
+	fast_cnt.prev_ticks = ticks;
+#if REGRESSION
+	reg_start();
+#endif
+	return;
+    }
+
+    uint8_t log2ne = fast_cnt.current_log2num_events;
+    tick_t period = ticks - fast_cnt.prev_ticks;
+    uint8_t mode = log2ne ? MODE_FAST : MODE_SLOW;
+    tick_t p = period;
+
+#if REGRESSION
+    if (reg_active(log2ne)) {
+	if (!reg_sample(period)) {
+	    return;		/* Not the last sub-period */
+	}
+	mode = MODE_REGRESSION;
+	p = reg_sxt;
+    }
+#endif
+    fast_cnt.prev_ticks = ticks;
+    if (period >= MIN_PUBLISH_PERIOD || log2ne == gate_max_log2ne) {
+	meas_push(mode, log2ne, p, ticks);
+    }
+
+    if (period < gate_min && log2ne < gate_max_log2ne) {
+	/*
+	 * Too short period. Count more events next time.
+	 */
+	do {
+	    log2ne++;
+	    period *= 2;
+	} while (period < gate_min && log2ne < gate_max_log2ne);
+    } else if (period > gate_max && log2ne > 0) {
+	/*
+	 * Too long period. Count fewer events next time.
+	 */
+	do {
+	    log2ne--;
+	    period /= 2;
+	} while (period > gate_max && log2ne > 0);
+    } else {
+	return;
+    }
+    fast_cnt.current_log2num_events = log2ne;
+    set_event_cmp_reg(log2ne);
+    current = log2ne ? &fast_cnt : &slow_cnt;
+}
+
+#endif
+
+#if TOTALIZE || DUTY || RATIO || BURST
+
+/*
+ * Stop counting frequency, so that another function can use the
+ * timers and the input.
+ */
+static void stop_event_counting(void)
+{
+    cli();
+#if ENGINE_ICP
+    TIMSK1 &= ~_BV(ICIE1);
+#else
+    GIMSK = 0;
+    TIMSK1 = 0;
+#endif
+    current = &slow_cnt;	/* Keep the watchdog quiet */
+    sei();
+}
+
+/*
+ * Start counting frequency again, in slow mode.
+ */
+static void restart_event_counting(void)
+{
+    cli();
+    init_event_counting();
+    sei();
+    slow_mode();
+}
+
+#endif
+
+#if TOTALIZE || RATIO || BURST
+
+/* =====================================================================
+ *
+ * Totalizer.
+ *
+ * The timer that counts the events in fast mode (timer 1, or timer 0
+ * when ENGINE_ICP is 1) is run in normal mode and counts every event.
+ * Its overflow interrupt extends the count by 32 bits in software,
+ * to 48 bits (40 bits for ENGINE_ICP). The count is read by main()
+ * when it is shown, so there is no interrupt for each event and the
+ * input may be as fast as for measuring the frequency. Counting is
+ * started and stopped by turning the clock of the timer on and off.
+ *
+ * The frequency counting is stopped while the totalizer is used.
+ * (The ratio and burst functions use the same counter; see below.)
+ *
+ * ====================================================================
+ */
+
+#if ENGINE_ICP
+#define TOTAL_TCNT TCNT0
+#define TOTAL_TCCRA TCCR0A
+#define TOTAL_TCCRB TCCR0B
+#define TOTAL_CLOCK (_BV(CS02) | _BV(CS01)) /* Falling edge on T0 */
+#define TOTAL_TIMSK TIMSK0
+#define TOTAL_TOIE TOIE0
+#define TOTAL_TIFR TIFR0
+#define TOTAL_TOV TOV0
+#define TOTAL_vect TIM0_OVF_vect
+#define TOTAL_BITS 8
+#else
+#define TOTAL_TCNT TCNT1
+#define TOTAL_TCCRA TCCR1A
+#define TOTAL_TCCRB TCCR1B
+#define TOTAL_CLOCK (_BV(CS12) | _BV(CS11)) /* Falling edge on T1 */
+#define TOTAL_TIMSK TIMSK1
+#define TOTAL_TOIE TOIE1
+#define TOTAL_TIFR TIFR1
+#define TOTAL_TOV TOV1
+#define TOTAL_vect TIM1_OVF_vect
+#define TOTAL_BITS 16
+#endif
+
+static volatile unsigned long total_high;
+
+ISR(TOTAL_vect)
+{
+    total_high++;
+}
+
+#endif
+
+#if TOTALIZE
+
+#define TOTAL_CLEARED 0
+#define TOTAL_RUNNING 1
+#define TOTAL_STOPPED 2
+
+static uint8_t total_state;
+static tick_t total_start_ticks;
+
+static void total_clear(void)
+{
+    cli();
+    TOTAL_TCNT = 0;
+    TOTAL_TIFR = _BV(TOTAL_TOV);
+    total_high = 0;
+    sei();
+    total_state = TOTAL_CLEARED;
+}
+
+/*
+ * Stop counting frequency and set up the timer for the totalizer
+ * (stopped and cleared).
+ */
+static void total_enter(void)
+{
+    stop_event_counting();
+    cli();
+    TOTAL_TCCRB = 0;
+    TOTAL_TCCRA = 0;
+    TOTAL_TIMSK |= _BV(TOTAL_TOIE);
+    sei();
+    total_clear();
+}
+
+/*
+ * Start counting frequency again.
+ */
+static void total_exit(void)
+{
+    cli();
+    TOTAL_TIMSK &= ~_BV(TOTAL_TOIE);
+    sei();
+    restart_event_counting();
+}
+
+/*
+ * Each press of the button starts, stops, or clears the count.
+ */
+static void total_press(tick_t now)
+{
+    switch (total_state) {
+    case TOTAL_CLEARED:
+	total_start_ticks = now;
+	TOTAL_TCCRB = TOTAL_CLOCK;
+	total_state = TOTAL_RUNNING;
+	break;
+    case TOTAL_RUNNING:
+	TOTAL_TCCRB = 0;
+	total_state = TOTAL_STOPPED;
+	break;
+    default:
+	total_clear();
+	break;
+    }
+}
+
+/*
+ * Stop counting at the end of the gate time. main() is woken up at
+ * least by each overflow of the timer that keeps the time, so the
+ * gate may be up to one lap of that timer too long: timer 0 (819 us
+ * at prescaler 64), or timer 1 when ENGINE_ICP is 1 (210 ms at
+ * prescaler 64, 3.3 ms at prescaler 1).
+ */
+static void total_poll(tick_t now)
+{
+#if TOTAL_GATE
+    if (total_state == TOTAL_RUNNING &&
+	now - total_start_ticks >= MS_TO_TICKS(TOTAL_GATE)) {
+	TOTAL_TCCRB = 0;
+	total_state = TOTAL_STOPPED;
+    }
+#endif
+}
+
+/*
+ * Show the count. If it has more than 8 digits, show it as
+ * d.dddEnn (truncated, not rounded).
+ */
+static void total_show(void)
+{
+    uint16_t n[3];		/* Most significant part first */
+    char digits[15];		/* Least significant digit first */
+    char line[9];
+    unsigned long h;
+    uint16_t t;
+    uint8_t len = 0;
+    uint8_t i;
+    signed char pos;
+
+    cli();
+    t = TOTAL_TCNT;
+    h = total_high;
+    if (TOTAL_TIFR & _BV(TOTAL_TOV) && t < (1U << (TOTAL_BITS-1))) {
+	h++;
+    }
+    sei();
+#if TOTAL_BITS == 8
+    n[0] = h >> 24;
+    n[1] = h >> 8;
+    n[2] = (h << 8) | t;
+#else
+    n[0] = h >> 16;
+    n[1] = h;
+    n[2] = t;
+#endif
+
+    /*
+     * Divide the 48-bit number by 10 using 16-bit parts.
+     */
+    do {
+	unsigned long r = 0;
+	for (i = 0; i < 3; i++) {
+	    r = (r << 16) | n[i];
+	    n[i] = r / 10;
+	    r %= 10;
+	}
+	digits[len++] = r + '0';
+    } while (n[0] | n[1] | n[2]);
+
+    line[8] = '\0';
+    if (len <= 8) {
+	for (pos = 7, i = 0; pos >= 0; pos--, i++) {
+	    line[pos] = i < len ? digits[i] : ' ';
+	}
+    } else {
+	uint8_t e = len - 1;
+	pos = 7;
+	line[pos--] = e % 10 + '0';
+	if (e >= 10) {
+	    line[pos--] = e / 10 + '0';
+	}
+	line[pos--] = 'E';
+	line[0] = digits[len-1];
+	line[1] = '.';
+	for (i = 2; i <= pos; i++) {
+	    line[i] = digits[len-i];
+	}
+    }
+    show_text(line);
+}
+
+#endif
+
+#if DUTY
+
+/* =====================================================================
+ *
+ * Duty cycle.
+ *
+ * Both edges of the input are timestamped by a pin change interrupt
+ * (on PB2, or on PA3 when ENGINE_ICP is 1, since timer 0 only counts
+ * one kind of edge). The level of the pin tells which edge it was;
+ * if it is the same as after the previous edge, an edge was missed
+ * and the measurement starts over.
+ *
+ * The high times of 2^n cycles are added up, and the total high time
+ * and the total period are published as two measurements with the
+ * same end time (MODE_HIGH first, then MODE_SLOW with 2^n events).
+ * As for the frequency, n is chosen so that the total period is
+ * between gate_min and gate_max ticks, so the times have the same
+ * resolution as frequencies. One interrupt for each edge limits the
+ * input to periods of at least DUTY_MIN_PERIOD; for faster inputs,
+ * the pin change interrupt is turned off for DUTY_HOLDOFF and "---"
+ * is shown.
+ *
+ * ====================================================================
+ */
+
+#if INPUT_PRESCALER > 1
+#error "The duty cycle cannot be measured through an external prescaler"
+#endif
+
+#if ENGINE_ICP
+#define DUTY_PIN PINA
+#define DUTY_BIT PA3
+#define DUTY_PCMSK PCMSK0
+#define DUTY_PCINT PCINT3
+#define DUTY_PCIE PCIE0
+#define DUTY_PCIF PCIF0
+#define DUTY_vect PCINT0_vect
+#else
+#define DUTY_PIN PINB
+#define DUTY_BIT PB2
+#define DUTY_PCMSK PCMSK1
+#define DUTY_PCINT PCINT10
+#define DUTY_PCIE PCIE1
+#define DUTY_PCIF PCIF1
+#define DUTY_vect PCINT1_vect
+#endif
+
+#define DUTY_MIN_PERIOD US_TO_TICKS(50)
+#define DUTY_HOLDOFF MS_TO_TICKS(100)
+
+#define DUTY_VIEW_DUTY 0
+#define DUTY_VIEW_HIGH 1
+#define DUTY_VIEW_LOW 2
+#define DUTY_VIEWS 3
+
+static volatile uint8_t duty_first;	/* No cycle started yet */
+static volatile uint8_t duty_phase;	/* The signal is high */
+static volatile uint8_t duty_log2n;
+static unsigned long duty_left;		/* Cycles left in this period */
+static tick_t duty_start;		/* Start of this period */
+static tick_t duty_rise;		/* Start of the current cycle */
+static tick_t duty_high;		/* Total high time */
+static tick_t duty_off_ticks;		/* When the interrupt was seen off */
+static uint8_t duty_off;
+static uint8_t duty_view;
+
+ISR(DUTY_vect)
+{
+    PROFILE_SCOPE(PROF_DUTY);
+    tick_t now = cli_ticks();
+    uint8_t high = (DUTY_PIN & _BV(DUTY_BIT)) == 0; /* Inverted input */
+
+    if (high == duty_phase) {
+	duty_first = 1;		/* Missed an edge */
+	return;
+    }
+    duty_phase = high;
+    if (!high) {
+	duty_high += now - duty_rise;
+	return;
+    }
+
+    /*
+     * The signal went high, which ends a cycle.
+     */
+    if (!duty_first && now - duty_rise < DUTY_MIN_PERIOD) {
+	GIMSK &= ~_BV(DUTY_PCIE);
+	meas_push(MODE_SLOW, 0, MAX_PERIOD, now);
+	duty_first = 1;
+	return;
+    }
+    if (duty_first) {
+	duty_first = 0;
+    } else if (--duty_left == 0) {
+	tick_t period = now - duty_start;
+	uint8_t n = duty_log2n;
+
+	meas_push(MODE_HIGH, n, duty_high, now);
+	meas_push(MODE_SLOW, n, period, now);
+	if (period < gate_min) {
+	    n = predict_log2ne(n, period);
+	} else {
+	    while (period > gate_max && n > 0) {
+		n--;
+		period /= 2;
+	    }
+	}
+	duty_log2n = n;
+    } else {
+	duty_rise = now;
+	return;
+    }
+    duty_start = now;
+    duty_rise = now;
+    duty_high = 0;
+    duty_left = 1UL << duty_log2n;
+}
+
+static void duty_enter(void)
+{
+    stop_event_counting();
+    cli();
+    duty_first = 1;
+    duty_phase = (DUTY_PIN & _BV(DUTY_BIT)) == 0;
+    duty_log2n = 0;
+    DUTY_PCMSK |= _BV(DUTY_PCINT);
+    GIFR = _BV(DUTY_PCIF);
+    GIMSK |= _BV(DUTY_PCIE);
+    sei();
+    duty_off = 0;
+}
+
+static void duty_exit(void)
+{
+    cli();
+    GIMSK &= ~_BV(DUTY_PCIE);
+    DUTY_PCMSK &= ~_BV(DUTY_PCINT);
+    sei();
+    restart_event_counting();
+}
+
+static void duty_press(void)
+{
+    if (++duty_view == DUTY_VIEWS) {
+	duty_view = DUTY_VIEW_DUTY;
+    }
+}
+
+/*
+ * Turn the pin change interrupt on again a while after the
+ * interrupt routine turned it off because the input was too fast.
+ */
+static void duty_poll(tick_t now)
+{
+    if (GIMSK & _BV(DUTY_PCIE)) {
+	duty_off = 0;
+    } else if (!duty_off) {
+	duty_off = 1;
+	duty_off_ticks = now;
+    } else if (now - duty_off_ticks >= DUTY_HOLDOFF) {
+	cli();
+	duty_first = 1;
+	duty_phase = (DUTY_PIN & _BV(DUTY_BIT)) == 0;
+	GIFR = _BV(DUTY_PCIF);
+	GIMSK |= _BV(DUTY_PCIE);
+	sei();
+    }
+}
+
+#endif
+
+#if RATIO
+
+/* =====================================================================
+ *
+ * Frequency ratio.
+ *
+ * Timer 1 counts the events of signal A on T1 (PA4) continuously, as
+ * for the totalizer. Each falling edge of signal B on INT0 (PB2)
+ * reads the count, and after 2^n edges of B, the number of events of
+ * A is published as a MODE_RATIO measurement with 2^n events. The
+ * ratio A/B is the count divided by 2^n, so it does not depend on the
+ * accuracy of the CPU clock; the clock is only used to choose n so
+ * that a measurement takes between gate_min and gate_max ticks.
+ *
+ * The count is read by the interrupt routine, so a variation of the
+ * interrupt latency (up to the length of the longest other interrupt
+ * routine) moves events of A from one measurement to the next. As
+ * the measurements follow each other without gaps, those errors do
+ * not add up.
+ *
+ * ====================================================================
+ */
+
+#if ENGINE_ICP
+#error "RATIO needs the two separate inputs of ENGINE_ICP 0"
+#endif
+
+#define RATIO_MIN_PERIOD US_TO_TICKS(50)
+#define RATIO_HOLDOFF MS_TO_TICKS(100)
+
+static uint8_t ratio_first;
+static uint8_t ratio_log2n;
+static unsigned long ratio_left;	/* Edges of B left */
+static unsigned long ratio_start;	/* Count of A at start */
+static tick_t ratio_start_ticks;
+static tick_t ratio_prev_ticks;		/* Time of previous edge of B */
+static tick_t ratio_off_ticks;
+static uint8_t ratio_off;
+
+/*
+ * Called from the interrupt routine for INT0 for each edge of B.
+ */
+static inline void ratio_edge(void)
+{
+    uint16_t t = TCNT1;		/* First, to get the least latency */
+    uint16_t h = total_high;
+    tick_t ticks = cli_ticks();
+    unsigned long a;
+
+    if (TIFR1 & _BV(TOV1) && t < 0x8000) {
+	h++;
+    }
+    a = ((unsigned long) h << 16) | t;
+
+    if (!ratio_first && ticks - ratio_prev_ticks < RATIO_MIN_PERIOD) {
+	/*
+	 * B is too fast for an interrupt for each edge.
+	 */
+	GIMSK = 0;
+	meas_push(MODE_RATIO, 0, MAX_PERIOD, ticks);
+	ratio_first = 1;
+	return;
+    }
+    ratio_prev_ticks = ticks;
+    if (ratio_first) {
+	ratio_first = 0;
+    } else if (--ratio_left == 0) {
+	tick_t period = ticks - ratio_start_ticks;
+	uint8_t n = ratio_log2n;
+
+	meas_push(MODE_RATIO, n, a - ratio_start, ticks);
+	if (period < gate_min) {
+	    n = predict_log2ne(n, period);
+	} else {
+	    while (period > gate_max && n > 0) {
+		n--;
+		period /= 2;
+	    }
+	}
+	ratio_log2n = n;
+    } else {
+	return;
+    }
+    ratio_start = a;
+    ratio_start_ticks = ticks;
+    ratio_left = 1UL << ratio_log2n;
+}
+
+/*
+ * Start counting A, and interrupt on each falling edge of B.
+ */
+static void ratio_enter(void)
+{
+    stop_event_counting();
+    cli();
+    TOTAL_TCCRB = 0;
+    TOTAL_TCCRA = 0;
+    TOTAL_TIFR = _BV(TOTAL_TOV);
+    TOTAL_TIMSK |= _BV(TOTAL_TOIE);
+    TOTAL_TCCRB = TOTAL_CLOCK;
+    ratio_first = 1;
+    ratio_log2n = 0;
+    ratio_on = 1;
+    GIFR = _BV(INTF0);
+    GIMSK = _BV(INT0);
+    sei();
+    ratio_off = 0;
+}
+
+static void ratio_exit(void)
+{
+    cli();
+    GIMSK = 0;
+    ratio_on = 0;
+    TOTAL_TIMSK &= ~_BV(TOTAL_TOIE);
+    sei();
+    restart_event_counting();
+}
+
+/*
+ * Turn the external interrupt on again a while after the interrupt
+ * routine turned it off because B was too fast.
+ */
+static void ratio_poll(tick_t now)
+{
+    if (GIMSK & _BV(INT0)) {
+	ratio_off = 0;
+    } else if (!ratio_off) {
+	ratio_off = 1;
+	ratio_off_ticks = now;
+    } else if (now - ratio_off_ticks >= RATIO_HOLDOFF) {
+	cli();
+	ratio_first = 1;
+	GIFR = _BV(INTF0);
+	GIMSK = _BV(INT0);
+	sei();
+    }
+}
+
+#endif
+
+#if BURST
+
+/* =====================================================================
+ *
+ * Burst mode.
+ *
+ * The input comes in bursts with pauses between them, such as a
+ * keyed carrier. Periods that span a pause would be meaningless, and
+ * the watchdog would switch to slow mode in each pause, so the
+ * frequency counting is stopped and timer 1 counts every event, as
+ * for the totalizer.
+ *
+ * The first edge (on INT0) after a pause of at least BURST_GAP starts
+ * a burst. BURST_DELAY after it, to let the burst settle, the window
+ * is opened at the next edge, and BURST_WINDOW after that, it is
+ * closed at the next edge. At both ends, the count and the time are
+ * read together at the start of the interrupt routine for the edge,
+ * so the events counted belong to the time measured (as for the
+ * ratio function), and the time is known to +/- one tick plus the
+ * jitter of the interrupt latency. The interrupt is only enabled while
+ * waiting for one of those edges, so there is no interrupt for each
+ * event.
+ *
+ * The interrupt for the closing edge is enabled by burst_poll() in
+ * the main loop, up to about 1 ms after BURST_WINDOW, so the bursts
+ * must be that much longer than BURST_DELAY + BURST_WINDOW. If the
+ * burst has ended before that, the closing edge comes too late (in
+ * the next burst), and the window is thrown away. burst_poll() also
+ * checks in every pass that the count is still running; if it has
+ * not changed for BURST_GAP, the burst has ended, and a window in
+ * progress is thrown away. Therefore, the input must have at least
+ * one event per BURST_GAP within a burst.
+ *
+ * The events and ticks of the windows are added up until there are
+ * gate_min ticks (as selected by the gate profile), which makes one
+ * reciprocal reading with the resolution of that many ticks. It is
+ * published as a MODE_FAST measurement, so that it is shown, sent
+ * on the serial line, filtered, and added to the statistics as any
+ * other. Since a measurement has 2^n events, the period is scaled
+ * to the next power of two above the number of events; the scaled
+ * period is at least as long as the real one, so rounding it costs
+ * less than the +/- one tick of the measurement itself.
+ *
+ * ====================================================================
+ */
+
+#if ENGINE_ICP
+#error "BURST needs the INT0 and T1 inputs of ENGINE_ICP 0"
+#endif
+
+#define BURST_ARMED 0		/* Waiting for the first edge */
+#define BURST_DELAYED 1		/* Waiting for BURST_DELAY */
+#define BURST_OPENING 2		/* Waiting for the edge that opens */
+#define BURST_OPEN 3		/* Waiting for BURST_WINDOW */
+#define BURST_CLOSING 4		/* Waiting for the edge that closes */
+#define BURST_CLOSED 5		/* Window ready to be added */
+#define BURST_ENDING 6		/* Waiting for a pause */
+
+static volatile uint8_t burst_state;
+static unsigned long burst_start;	/* Count at the start of the window */
+static unsigned long burst_end;		/* Count at the end */
+static tick_t burst_ticks;		/* Time of the latest edge used */
+static tick_t burst_start_ticks;
+static unsigned long burst_count;	/* Count seen by burst_poll() */
+static tick_t burst_count_ticks;	/* When it last changed */
+static unsigned long burst_sum_events;
+static tick_t burst_sum_ticks;
+
+/*
+ * Return the count of events. Interrupts must be disabled.
+ */
+static inline unsigned long burst_read(void)
+{
+    uint16_t t = TCNT1;
+    uint16_t h = total_high;
+
+    if (TIFR1 & _BV(TOV1) && t < 0x8000) {
+	h++;
+    }
+    return ((unsigned long) h << 16) | t;
+}
+
+/*
+ * Called from the interrupt routine for INT0 for the edge that the
+ * current state waits for.
+ */
+static inline void burst_edge(void)
+{
+    unsigned long a = burst_read(); /* First, to get the least latency */
+    tick_t ticks = cli_ticks();
+
+    GIMSK = 0;
+    switch (burst_state) {
+    case BURST_OPENING:
+	burst_start = a;
+	burst_start_ticks = ticks;
+	burst_state = BURST_OPEN;
+	break;
+    case BURST_CLOSING:
+	burst_end = a;
+	burst_state = BURST_CLOSED;
+	break;
+    default:
+	burst_state = BURST_DELAYED;
+	break;
+    }
+    burst_ticks = ticks;
+}
+
+/*
+ * Go to 'state' and wait for the next edge.
+ */
+static void burst_wait_edge(uint8_t state)
+{
+    cli();
+    burst_state = state;
+    GIFR = _BV(INTF0);		/* Forget any old edge */
+    GIMSK = _BV(INT0);
+    sei();
+}
+
+/*
+ * Start counting every event, and wait for a pause.
+ */
+static void burst_enter(void)
+{
+    stop_event_counting();
+    cli();
+    TOTAL_TCCRB = 0;
+    TOTAL_TCCRA = 0;
+    TOTAL_TIFR = _BV(TOTAL_TOV);
+    TOTAL_TIMSK |= _BV(TOTAL_TOIE);
+    TOTAL_TCCRB = TOTAL_CLOCK;
+    burst_state = BURST_ENDING;
+    burst_on = 1;
+    sei();
+    burst_sum_events = 0;
+    burst_sum_ticks = 0;
+}
+
+static void burst_exit(void)
+{
+    cli();
+    GIMSK = 0;
+    burst_on = 0;
+    TOTAL_TIMSK &= ~_BV(TOTAL_TOIE);
+    sei();
+    restart_event_counting();
+}
+
+/*
+ * Publish the windows added up so far, ending at 'ticks'.
+ */
+static void burst_publish(tick_t ticks)
+{
+    uint8_t n = 0;
+    tick_t period;
+
+    while ((1UL << n) < burst_sum_events) {
+	n++;
+    }
+    period = mul_div(burst_sum_ticks, 1, n, burst_sum_events);
+    cli();
+    meas_push(MODE_FAST, n, period, ticks);
+    sei();
+}
+
+/*
+ * Move the window along, and add up the windows that are done.
+ */
+static void burst_poll(tick_t now)
+{
+    unsigned long a;
+    uint8_t state;
+
+    cli();
+    a = burst_read();
+    state = burst_state;
+    sei();
+
+    if (a != burst_count) {
+	burst_count = a;
+	burst_count_ticks = now;
+    } else if (now - burst_count_ticks >= MS_TO_TICKS(BURST_GAP) &&
+	       state != BURST_ARMED) {
+	/*
+	 * A pause. Any window not closed yet is thrown away, and
+	 * the next edge starts a new burst.
+	 */
+	cli();
+	if (burst_state != BURST_CLOSED) {
+	    burst_state = BURST_ARMED;
+	    GIFR = _BV(INTF0);
+	    GIMSK = _BV(INT0);
+	}
+	state = burst_state;
+	sei();
+    }
+
+    switch (state) {
+    case BURST_DELAYED:
+	if (now - burst_ticks >= MS_TO_TICKS(BURST_DELAY)) {
+	    burst_wait_edge(BURST_OPENING);
+	}
+	break;
+    case BURST_OPEN:
+	if (now - burst_ticks >= MS_TO_TICKS(BURST_WINDOW)) {
+	    burst_wait_edge(BURST_CLOSING);
+	}
+	break;
+    case BURST_CLOSED:
+	/*
+	 * An edge long after the window should have closed may
+	 * belong to the next burst.
+	 */
+	if (burst_ticks - burst_start_ticks <=
+	    MS_TO_TICKS(BURST_WINDOW + BURST_GAP)) {
+	    burst_sum_events += burst_end - burst_start;
+	    burst_sum_ticks += burst_ticks - burst_start_ticks;
+	    if (burst_sum_ticks >= gate_min) {
+		burst_publish(burst_ticks);
+		burst_sum_events = 0;
+		burst_sum_ticks = 0;
+	    }
+	}
+	burst_state = BURST_ENDING;
+	break;
+    }
+}
+
+#endif
+
+#if SERIAL
+
+/* =====================================================================
+ *
+ * Serial output.
+ *
+ * Each measurement taken out of the ring buffer is sent as a frame
+ * of SERIAL_FRAME_SIZE bytes:
+ *
+ *   0     SERIAL_SYNC (0xA5)
+ *   1     Sequence number (incremented for each frame)
+ *   2     Mode (MODE_SLOW, MODE_FAST, or MODE_REGRESSION)
+ *   3     log2 of the number of events
+ *   4-7   Period in ticks (little endian)
+ *   8-11  Time in ticks at the end of the period (little endian)
+ *   12    Checksum (the sum of bytes 1 to 12 is zero)
+ *
+ * The frequency is calculated by the receiver as described for
+ * display_measurement(): 2^n * TICK_HZ / period, except that for
+ * MODE_REGRESSION it is 2^n * REG_GAIN * TICK_HZ / period.
+ *
+ * The bits are sent by the output compare unit B of the timer that
+ * keeps the time. The interrupt routine sets up the level of the
+ * next bit and the time of the next compare match, and the timer
+ * changes the pin at exactly that time. Therefore, the bit times do
+ * not depend on interrupt latency (as long as it is less than one
+ * bit time). The length of a bit is kept in 1/256 ticks, so that
+ * the baud rate need not be a divisor of the tick frequency.
+ *
+ * The bytes are sent from a queue with room for two frames.
+ * A frame is only put into the queue if there is room for all of
+ * it, so that the previous frame can be sent while the next one
+ * is put into the queue, and frames that cannot be sent before the
+ * next one is ready are dropped. (The receiver will notice a gap
+ * in the sequence numbers.)
+ *
+ * ====================================================================
+ */
+
+#if ENGINE_ICP
+#define SERIAL_TX_BIT PA5	/* OC1B */
+#define SERIAL_TCCRA TCCR1A
+#define SERIAL_COM0 COM1B0
+#define SERIAL_COM1 COM1B1
+#define SERIAL_TCCRF TCCR1C
+#define SERIAL_FOC FOC1B
+#define SERIAL_TCNT TCNT1
+#define SERIAL_OCR OCR1B
+#define SERIAL_TIMSK TIMSK1
+#define SERIAL_OCIE OCIE1B
+#define SERIAL_TIFR TIFR1
+#define SERIAL_OCF OCF1B
+#define SERIAL_vect TIM1_COMPB_vect
+#define SERIAL_TIMER_BITS 16
+#if DEBUG || DOG_SPI_USI
+#error "SERIAL with ENGINE_ICP uses PA5, which is used by DEBUG and DOG_SPI_USI"
+#endif
+#else
+#define SERIAL_TX_BIT PA7	/* OC0B */
+#define SERIAL_TCCRA TCCR0A
+#define SERIAL_COM0 COM0B0
+#define SERIAL_COM1 COM0B1
+#define SERIAL_TCCRF TCCR0B
+#define SERIAL_FOC FOC0B
+#define SERIAL_TCNT TCNT0
+#define SERIAL_OCR OCR0B
+#define SERIAL_TIMSK TIMSK0
+#define SERIAL_OCIE OCIE0B
+#define SERIAL_TIFR TIFR0
+#define SERIAL_OCF OCF0B
+#define SERIAL_vect TIM0_COMPB_vect
+#define SERIAL_TIMER_BITS 8
+#endif
+
+/* Length of one bit in 1/256 ticks. */
+#define SERIAL_BIT ((256UL * TICK_HZ + SERIAL_BAUD/2) / SERIAL_BAUD)
+
+#if SERIAL_BIT < 8 * 256
+#error "SERIAL_BAUD is too high for TICK_PRESCALER (less than 8 ticks per bit)"
+#endif
+#if (SERIAL_BIT >> 8) >= (1UL << SERIAL_TIMER_BITS)
+#error "SERIAL_BAUD is too low for TICK_PRESCALER"
+#endif
+
+#define SERIAL_SYNC 0xA5
+#define SERIAL_FRAME_SIZE 13
+#define SERIAL_QUEUE_SIZE 32	/* Must be a power of two */
+
+static volatile uint8_t serial_queue[SERIAL_QUEUE_SIZE];
+static volatile uint8_t serial_head;	/* Written by serial_put() */
+static volatile uint8_t serial_tail;	/* Written by the interrupt */
+static uint8_t serial_shift;		/* Bits left of the current byte */
+static uint8_t serial_bits;		/* Number of bits left to set up */
+static uint8_t serial_frac;		/* Fraction of a tick */
+static uint8_t serial_seq;		/* Sequence number */
+
+/*
+ * Set the TX pin to output a high level (idle).
+ */
+static void serial_init(void)
+{
+    SERIAL_TCCRA |= _BV(SERIAL_COM1) | _BV(SERIAL_COM0);
+    SERIAL_TCCRF |= _BV(SERIAL_FOC);
+    DDRA |= _BV(SERIAL_TX_BIT);
+}
+
+static uint8_t serial_room(void)
+{
+    return (serial_tail - serial_head - 1) & (SERIAL_QUEUE_SIZE-1);
+}
+
+static void serial_put(uint8_t b)
+{
+    uint8_t head = serial_head;
+
+    serial_queue[head] = b;
+    serial_head = (head + 1) & (SERIAL_QUEUE_SIZE-1);
+}
+
+static uint8_t serial_put_long(uint8_t sum, unsigned long v)
+{
+    uint8_t i;
+
+    for (i = 0; i < 4; i++) {
+	serial_put((uint8_t) v);
+	sum += (uint8_t) v;
+	v >>= 8;
+    }
+    return sum;
+}
+
+static void serial_send(struct measurement* m)
+{
+    uint8_t sum;
+
+    if (serial_room() < SERIAL_FRAME_SIZE) {
+	serial_seq++;		/* Dropped */
+	return;
+    }
+    serial_put(SERIAL_SYNC);
+    serial_put(serial_seq);
+    serial_put(m->mode);
+    serial_put(m->log2num_events);
+    sum = serial_seq + m->mode + m->log2num_events;
+    sum = serial_put_long(sum, m->period);
+    sum = serial_put_long(sum, m->end_ticks);
+    serial_put(-sum);
+    serial_seq++;
+
+    /*
+     * Start the interrupt if it was idle.
+     */
+    cli();
+    if ((SERIAL_TIMSK & _BV(SERIAL_OCIE)) == 0) {
+	SERIAL_OCR = SERIAL_TCNT + 2;
+	SERIAL_TIFR = _BV(SERIAL_OCF);
+	SERIAL_TIMSK |= _BV(SERIAL_OCIE);
+    }
+    sei();
+}
+
+/*
+ * Set up the next bit. The line is high (the previous stop bit or
+ * idle) when there are no bits left of the current byte.
+ */
+ISR(SERIAL_vect)
+{
+    PROFILE_SCOPE(PROF_SERIAL);
+    uint8_t level;
+    unsigned long t;
+
+    if (serial_bits == 0) {
+	uint8_t tail = serial_tail;
+	if (tail == serial_head) {
+	    SERIAL_TIMSK &= ~_BV(SERIAL_OCIE);
+	    return;
+	}
+	serial_shift = serial_queue[tail];
+	serial_tail = (tail + 1) & (SERIAL_QUEUE_SIZE-1);
+	serial_bits = 10;
+	level = 0;		/* Start bit */
+    } else if (serial_bits == 1) {
+	level = 1;		/* Stop bit */
+    } else {
+	level = serial_shift & 1;
+	serial_shift >>= 1;
+    }
+    serial_bits--;
+
+    if (level) {
+	SERIAL_TCCRA |= _BV(SERIAL_COM0); /* Set on match */
+    } else {
+	SERIAL_TCCRA &= ~_BV(SERIAL_COM0); /* Clear on match */
+    }
+    t = serial_frac + SERIAL_BIT;
+    serial_frac = (uint8_t) t;
+    SERIAL_OCR += t >> 8;
+}
+
+#endif
+
+/* ================================================================
+ *
+ * Display the frequency from the last measurement.
+ *
+ * ================================================================
+ */
+
+/*
+ * Calculate (hi * 2^32 + lo + d/2) / d, that is the 64-bit number
+ * hi:lo divided by d and rounded to the nearest integer. Return
+ * 0xffffffff if the result does not fit in 32 bits.
+ *
+ * The dividend is 64 bits, but since the quotient fits in
+ * 32 bits, the division is done by 32 steps of shift-and-subtract
+ * on a 32-bit remainder. Each step is a 64-bit shift, a 32-bit
+ * compare and subtract, and the loop test: about 25 AVR instructions,
+ * most of them single-cycle, so the division is bounded by about
+ * 32 * 30 = 960 cycles (48 us at 20Mhz). That bound is counted from
+ * the code, not measured; "make profile-run" measures the
+ * display_measurement() that calls it where simavr is installed.
+ * It is considerably faster than the unsigned long long division
+ * from libgcc, which also needs a lot more flash.
+ */
+static unsigned long div64(unsigned long hi, unsigned long lo,
+			   unsigned long d)
+{
+    unsigned long rem = hi;
+    unsigned long q = lo;
+    uint8_t i;
+
+    if (rem >= d) {
+	return 0xffffffffUL;
+    }
+
+    /*
+     * Shift the dividend left through rem, one bit at a time,
+     * shifting in the quotient bits from the right.
+     */
+    for (i = 0; i < 32; i++) {
+	uint8_t carry = (rem & 0x80000000UL) != 0;
+	rem = (rem << 1) | (q >> 31);
+	q <<= 1;
+	if (carry || rem >= d) {
+	    rem -= d;
+	    q |= 1;
+	}
+    }
+
+    /* Round to nearest, without wrapping around to 0. */
+    if (rem >= d - rem && q != 0xffffffffUL) {
+	q++;
+    }
+    return q;
+}
+
+/*
+ * Calculate a * b * 2^s / d rounded to the nearest integer, for
+ * 0 <= s < 32. Return 0xffffffff if the result does not fit in 32
+ * bits.
+ *
+ * The number of events (b) is almost always a power of two, and then
+ * the product is just a shift of a: at most 3 byte steps and 7 bit
+ * steps find the exponent. Otherwise the 64-bit product is calculated
+ * by 32 steps of shift-and-add, which takes about as long as the
+ * division.
+ */
+static unsigned long mul_div(unsigned long a, unsigned long b, uint8_t s,
+			     unsigned long d)
+{
+    unsigned long hi = 0;
+    unsigned long lo = 0;
+    uint8_t i;
+
+    if (b && (b & (b - 1)) == 0) {
+	lo = a;
+	while (b >= 0x100) {
+	    b >>= 8;
+	    s += 8;
+	}
+	while (b > 1) {
+	    b >>= 1;
+	    s++;
+	}
+	if (s >= 32) {
+	    hi = lo;
+	    lo = 0;
+	    s -= 32;
+	}
+    } else {
+	for (i = 0; i < 32; i++) {
+	    hi = (hi << 1) | (lo >> 31);
+	    lo <<= 1;
+	    if (b & 0x80000000UL) {
+		lo += a;
+		if (lo < a) {
+		    hi++;
+		}
+	    }
+	    b <<= 1;
+	}
+    }
+    if (s) {
+	if (hi >> (32 - s)) {
+	    return 0xffffffffUL;
+	}
+	hi = (hi << s) | (lo >> (32 - s));
+	lo <<= s;
+    }
+    return div64(hi, lo, d);
+}
+
+/*
+ * Frequency in dHz, and in units of 0.1 mHz for low frequencies.
+ * With an input prescaler, frequencies up to 999.9MHz must fit in
+ * 32 bits, so Hz is used instead of dHz. Since the division factor
+ * is part of the configuration, calc_init() chooses the unit.
+ */
+static uint8_t freq_decimals;		/* 1 (dHz), or 0 (Hz) */
+#define FREQ_DECIMALS freq_decimals
+#define FREQ_SCALE ((unsigned long long) TICK_HZ)	/* For Hz */
+#define FINE_SCALE (10000ULL * TICK_HZ)
+#define FINE_LIMIT (freq_decimals ? 9900UL : 990UL) /* 990Hz */
+
+/*
+ * The scale factors used by calc_freq(): FREQ_SCALE (times 10 for
+ * dHz), FINE_SCALE, and (for REGRESSION) the same times REG_GAIN,
+ * all multiplied by the division factor of the input prescaler.
+ * Each one is kept as a 32-bit factor and a shift, so that the
+ * frequency is
+ *
+ *    factor * events * 2^shift / ticks
+ *
+ * which is what mul_div() calculates. Since the division factor is
+ * part of the configuration, they are calculated at startup.
+ */
+#define NUM_SCALES (REGRESSION ? 4 : 2)
+static struct {
+    unsigned long factor;
+    uint8_t shift;
+} scales[NUM_SCALES];
+
+/*
+ * Set scale i to the 64-bit number hi:lo times the division factor
+ * of the input prescaler, shifted right until it fits in 32 bits.
+ */
+static void scale_init(uint8_t i, unsigned long hi, unsigned long lo)
+{
+    unsigned long p = config.prescaler;
+    unsigned long a = (lo & 0xffff) * p;
+    unsigned long b = (lo >> 16) * p;
+    uint8_t shift = 0;
+
+    hi = hi * p + (b >> 16);
+    lo = a + (b << 16);
+    if (lo < a) {
+	hi++;
+    }
+    while (hi) {
+	lo = (lo >> 1) | (hi << 31);
+	hi >>= 1;
+	shift++;
+    }
+    scales[i].factor = lo;
+    scales[i].shift = shift;
+}
+
+#define SCALE_INIT(i, x)						\
+    scale_init((i), (unsigned long) ((x) >> 32), (unsigned long) (x))
+
+static void calc_init(void)
+{
+    freq_decimals = config.prescaler == 1;
+    if (freq_decimals) {
+	SCALE_INIT(0, 10 * FREQ_SCALE);
+#if REGRESSION
+	SCALE_INIT(2, REG_GAIN * 10 * FREQ_SCALE);
+#endif
+    } else {
+	SCALE_INIT(0, FREQ_SCALE);
+#if REGRESSION
+	SCALE_INIT(2, REG_GAIN * FREQ_SCALE);
+#endif
+    }
+    SCALE_INIT(1, FINE_SCALE);
+#if REGRESSION
+    SCALE_INIT(3, REG_GAIN * FINE_SCALE);
+#endif
+}
+
+/*
+ * The most digits that fit on the display (with a decimal point).
+ */
+#define MAX_DIGITS 7
+
+/*
+ * Calculate the frequency from a measurement, in dHz (Hz if there
+ * is an input prescaler), or in 0.1 mHz if 'fine' is 1.
+ *
+ * Here we want to calculate the frequency in dHz
+ * (tenths of Hz). We use dHz instead of Hz so that
+ * we don't have to use any floating point arithmetics.
+ *
+ * The frequency expressed in ticks is events / ticks, where
+ * the number of events is normally 1 << n.
+ * To get the frequency in Hz we must multiply by the
+ * tick frequency, which is TICK_HZ (F_CPU / TICK_PRESCALER).
+ * To get dHz we must multiply by 10. That is, the frequency
+ * in dHz is:
+ *
+ *    10 * TICK_HZ * events / ticks
+ *
+ * To round up to the nearest dHz, we first add ticks / 2
+ * before the division. Thus the final formula is:
+ *
+ *    (10 * TICK_HZ * events + ticks / 2) / ticks
+ *
+ * For more than 2^10 events, the dividend does not fit in 32
+ * bits (10*20000000/64 << 11 > 0xffffffff). mul_div()
+ * handles all numbers of events, and shifts instead of multiplying
+ * when the number is a power of two.
+ *
+ * In regression mode, 'ticks' is the regression sum Sxt, which is
+ * REG_GAIN times the length of the period.
+ *
+ * An input prescaler divides the frequency before it is measured,
+ * so its division factor is part of the scale factor.
+ *
+ * With CALIBRATE, the true tick frequency differs from TICK_HZ by
+ * the correction found by calibration, which is applied last.
+ */
+static unsigned long calc_freq(uint8_t mode, unsigned long events,
+			       tick_t ticks, uint8_t fine)
+{
+    uint8_t i = fine;
+    unsigned long f;
+
+#if REGRESSION
+    if (mode == MODE_REGRESSION) {
+	i += 2;
+    }
+#endif
+    f = mul_div(scales[i].factor, events, scales[i].shift, ticks);
+#if CALIBRATE
+    f = cal_correct(f);
+#endif
+    return f;
+}
+
+static uint8_t count_digits(unsigned long v)
+{
+    uint8_t n = 1;
+
+    while (v >= 10) {
+	v /= 10;
+	n++;
+    }
+    return n;
+}
+
+static void display_measurement(uint8_t mode, unsigned long events,
+				tick_t ticks)
+{
+    PROFILE_SCOPE(PROF_DISPLAY);
+    tick_t period = ticks;
+    unsigned long f;
+    uint8_t digits;
+
+    if (ticks == 0) {
+	show_line("---");
+	return;
+    }
+
+#if REGRESSION
+    if (mode == MODE_REGRESSION) {
+	period = ticks / REG_GAIN;
+    }
+#endif
+
+    /*
+     * The period is only known to +/- one tick, so a period of at
+     * least 10^d ticks gives d significant digits.
+     */
+    digits = count_digits(period) - 1;
+    if (digits > MAX_DIGITS) {
+	digits = MAX_DIGITS;
+    }
+
+    f = calc_freq(mode, events, ticks, 0);
+    if (f < FINE_LIMIT && count_digits(f) < digits) {
+	/*
+	 * There are more significant digits than whole dHz.
+	 */
+	f = calc_freq(mode, events, ticks, 1);
+	display_freq(f, 4, digits, ' ');
+    } else {
+	display_freq(f, FREQ_DECIMALS, digits, ' ');
+    }
+}
+
+/*
+ * Show the upper bound of the frequency when no edge has come for
+ * 'elapsed' ticks, for example "<0.235Hz".
+ */
+static void display_bound(tick_t elapsed)
+{
+    PROFILE_SCOPE(PROF_DISPLAY);
+    unsigned long f = calc_freq(MODE_SLOW, 1, elapsed, 0);
+
+    if (f < FINE_LIMIT) {
+	display_freq(calc_freq(MODE_SLOW, 1, elapsed, 1), 4,
+		     BOUND_DIGITS, '<');
+    } else {
+	display_freq(f, FREQ_DECIMALS, BOUND_DIGITS, '<');
+    }
+}
+
+#if FILTER
+
+/* ================================================================
+ *
+ * Filtering.
+ *
+ * The latest measurements (at most config.filter_depth of them, and
+ * never more than FILTER_DEPTH, covering at most FILTER_SPAN ticks)
+ * are kept in a ring buffer. Since the span is limited, the number
+ * of measurements adapts to their length: in slow mode at 1Hz there
+ * is only one, while in fast mode there are up to filter_depth. The
+ * display is still updated after each measurement. The ring buffer
+ * is emptied when the mode changes.
+ *
+ * FILTER_SUM keeps the total number of events and ticks of the
+ * measurements in the ring buffer, adding the newest and subtracting
+ * the oldest. When the periods follow directly after each other,
+ * the totals are a single reciprocal measurement over the whole
+ * span, with the same +/- one tick uncertainty as one measurement.
+ * Therefore, the ring buffer is also emptied when a measurement does
+ * not start where the previous one ended (or in regression mode,
+ * where the period is not a time).
+ *
+ * FILTER_MEDIAN shows the measurement in the ring buffer with the
+ * median frequency, which removes single wild measurements from a
+ * noisy input. filter_order[] holds the ring buffer indexes sorted
+ * by frequency; filter_add() moves the entries it removes and
+ * inserts, so the median is simply the middle entry.
+ *
+ * ================================================================
+ */
+
+#define FILTER_SUM 1
+#define FILTER_MEDIAN 2
+#define FILTER_DEPTH 8		/* Size of the ring; a power of two */
+#define FILTER_SPAN MS_TO_TICKS(1000)
+
+static struct {
+    unsigned long events;
+    tick_t ticks;
+#if FILTER == FILTER_MEDIAN
+    unsigned long freq;		/* For sorting */
+#endif
+} filter_buf[FILTER_DEPTH];
+static uint8_t filter_head;		/* Next entry to write */
+static uint8_t filter_count;
+static uint8_t filter_mode;
+static tick_t filter_end;		/* End of the latest period */
+static tick_t filter_span;		/* Time covered (in ticks) */
+static unsigned long filter_events;	/* Total number of events */
+static tick_t filter_ticks;		/* Total number of ticks */
+#if FILTER == FILTER_MEDIAN
+static uint8_t filter_order[FILTER_DEPTH]; /* Sorted by frequency */
+#endif
+
+/*
+ * Return the length of a period in ticks.
+ */
+static tick_t filter_duration(tick_t ticks)
+{
+#if REGRESSION
+    if (filter_mode == MODE_REGRESSION) {
+	return ticks / REG_GAIN;
+    }
+#endif
+    return ticks;
+}
+
+#if FILTER == FILTER_MEDIAN
+/*
+ * Remove ring buffer entry 'i' from filter_order[] (which must
+ * still count it in filter_count).
+ */
+static void filter_unsort(uint8_t i)
+{
+    uint8_t j = 0;
+
+    while (filter_order[j] != i) {
+	j++;
+    }
+    for (; j + 1 < filter_count; j++) {
+	filter_order[j] = filter_order[j+1];
+    }
+}
+
+/*
+ * Insert ring buffer entry 'i' in filter_order[] (which must not
+ * yet count it in filter_count), after any entries with the same
+ * frequency.
+ */
+static void filter_sort(uint8_t i)
+{
+    uint8_t j = filter_count;
+
+    while (j && filter_buf[filter_order[j-1]].freq > filter_buf[i].freq) {
+	filter_order[j] = filter_order[j-1];
+	j--;
+    }
+    filter_order[j] = i;
+}
+#endif
+
+static void filter_add(struct measurement* m)
+{
+    unsigned long events = 1UL << m->log2num_events;
+    tick_t duration;
+    uint8_t restart;
+    uint8_t i;
+
+    restart = m->period == MAX_PERIOD || m->mode != filter_mode;
+#if FILTER == FILTER_SUM
+    restart = restart || m->mode == MODE_REGRESSION ||
+	m->end_ticks - m->period != filter_end;
+#endif
+    if (restart) {
+	filter_count = 0;
+	filter_span = 0;
+	filter_events = 0;
+	filter_ticks = 0;
+    }
+    filter_mode = m->mode;
+    filter_end = m->end_ticks;
+    duration = filter_duration(m->period);
+
+    /*
+     * Remove the oldest measurements to make room for this one.
+     */
+    while (filter_count && (filter_count >= config.filter_depth ||
+			    filter_span + duration > FILTER_SPAN)) {
+	i = (filter_head - filter_count) & (FILTER_DEPTH-1);
+	filter_span -= filter_duration(filter_buf[i].ticks);
+	filter_events -= filter_buf[i].events;
+	filter_ticks -= filter_buf[i].ticks;
+#if FILTER == FILTER_MEDIAN
+	filter_unsort(i);
+#endif
+	filter_count--;
+    }
+
+    i = filter_head;
+    filter_buf[i].events = events;
+    filter_buf[i].ticks = m->period;
+#if FILTER == FILTER_MEDIAN
+    filter_buf[i].freq = calc_freq(m->mode, events, m->period, 0);
+    filter_sort(i);
+#endif
+    filter_head = (i + 1) & (FILTER_DEPTH-1);
+    filter_count++;
+    filter_span += duration;
+    filter_events += events;
+    filter_ticks += m->period;
+}
+
+static void filter_show(void)
+{
+#if FILTER == FILTER_SUM
+    display_measurement(filter_mode, filter_events, filter_ticks);
+#else
+    uint8_t a;
+
+    if (filter_count == 0) {
+	display_measurement(filter_mode, 0, 0);
+	return;
+    }
+    a = filter_order[filter_count / 2];
+    display_measurement(filter_mode, filter_buf[a].events,
+			filter_buf[a].ticks);
+#endif
+}
+
+#endif
+
+#if CALIBRATE
+
+/* ================================================================
+ *
+ * Calibration.
+ *
+ * A 1PPS signal on the input is measured in slow mode as usual. The
+ * periods of the measurements must follow directly after each other,
+ * and each second must be within CAL_LIMIT of TICK_HZ ticks, or
+ * the calibration starts over. After CAL_SECONDS seconds, the number
+ * of ticks they took is the true number of ticks in CAL_SECONDS
+ * seconds; it is shown as the deviation from the nominal tick
+ * frequency, and a short press of the button saves it in the
+ * configuration.
+ *
+ * The correction is kept as that number of ticks, so a frequency is
+ * corrected by multiplying it by cal_ticks / CAL_NOMINAL. At
+ * prescaler 64, one tick in 64 seconds is 0.05 ppm.
+ *
+ * ================================================================
+ */
+
+#define CAL_NOMINAL ((unsigned long) TICK_HZ * CAL_SECONDS)
+#define CAL_LIMIT(t) ((t) >> 10)	/* About 1000 ppm */
+
+#if TICK_HZ * CAL_SECONDS > 0xffffffff
+#error "CAL_SECONDS is too long for TICK_HZ"
+#endif
+#if CAL_SECONDS > 999
+#error "CAL_SECONDS must be less than 1000"
+#endif
+
+static unsigned long cal_ticks = CAL_NOMINAL; /* Correction in use */
+static unsigned long cal_result;	/* Latest correction, or 0 */
+static unsigned long cal_sum;		/* Ticks so far */
+static unsigned cal_seconds;		/* Number of seconds so far */
+static tick_t cal_end;			/* End of the last period */
+
+/*
+ * Use the saved correction, unless it is missing or out of range.
+ */
+static void cal_init(void)
+{
+    unsigned long t = config.cal_ticks;
+
+    if (t - (CAL_NOMINAL - CAL_LIMIT(CAL_NOMINAL)) <=
+	2 * CAL_LIMIT(CAL_NOMINAL)) {
+	cal_ticks = t;
+    }
+}
+
+static void cal_enter(void)
+{
+    cal_result = 0;
+    cal_seconds = 0;
+}
+
+/*
+ * Add a measurement of the 1PPS signal.
+ */
+static void cal_add(struct measurement* m)
+{
+    uint8_t n = m->log2num_events;
+    tick_t expected = (tick_t) TICK_HZ << n;
+
+    /*
+     * A period of MAX_PERIOD is far out of range. At most 32 seconds
+     * are measured at once with any gate profile.
+     */
+    if (m->mode != MODE_SLOW || n > 5 ||
+	m->period - (expected - CAL_LIMIT(expected)) >
+	2 * CAL_LIMIT(expected)) {
+	cal_seconds = 0;
+	return;
+    }
+    if (cal_seconds == 0 || m->end_ticks - m->period != cal_end) {
+	cal_seconds = 0;
+	cal_sum = 0;
+    }
+    cal_end = m->end_ticks;
+    cal_sum += m->period;
+    cal_seconds += 1 << n;
+    if (cal_seconds >= CAL_SECONDS) {
+	cal_result = mul_div(cal_sum, CAL_SECONDS, 0, cal_seconds);
+	cal_seconds = 0;
+    }
+}
+
+/*
+ * Save and use the latest correction. Without one, go back to
+ * the nominal tick frequency. Return the message to show.
+ */
+static const char* cal_press(void)
+{
+    if (!cal_result) {
+	cal_ticks = CAL_NOMINAL;
+	config.cal_ticks = 0;
+	config_save();
+	return "Cleared";
+    }
+    cal_ticks = cal_result;
+    config.cal_ticks = cal_ticks;
+    config_save();
+    return "Saved";
+}
+
+static unsigned long cal_correct(unsigned long f)
+{
+    if (cal_ticks == CAL_NOMINAL) {
+	return f;
+    }
+    return mul_div(f, cal_ticks, 0, CAL_NOMINAL);
+}
+
+#endif
+
+#if STATS
+
+/* ================================================================
+ *
+ * Statistics.
+ *
+ * Each measurement of the frequency is added to the statistics in
+ * constant time and memory, using integer arithmetic only. The
+ * statistics start over when a measurement can't be compared with
+ * the previous ones: when the mode or the number of events changes,
+ * or when a period does not start where the previous one ended. (In
+ * regression mode, the period is not a time, so that is not checked;
+ * the periods follow after each other anyway.)
+ *
+ * STATS_MOMENTS: The mean and the variance are updated as in
+ * Welford's algorithm. The value x is the difference between the
+ * frequency and the first one (stats_ref), with STATS_FRAC
+ * fractional bits, so that the mean and the sum of squares m2 are
+ * exact fixed-point numbers except for the rounding of the mean:
+ *
+ *    mean' = mean + (x - mean) / n
+ *    m2' = m2 + (x - mean) * (x - mean')
+ *
+ * The variance is m2 / (n - 1).
+ *
+ * STATS_ADEV: The overlapping Allan deviation for tau = m * tau0,
+ * where tau0 is the length of one measurement and m = 1, 2, 4, ...,
+ * 2^(STATS_TAUS-1), is calculated from the phase. The phase is the
+ * time at the end of each measurement, and since that is an integer
+ * number of ticks, the second difference
+ *
+ *    t[i] - 2 * t[i-m] + t[i-2m]
+ *
+ * is exact (the nominal frequency cancels out). With N times, there
+ * are N - 2m second differences, and
+ *
+ *    ADEV(m * tau0)^2 = (sum of their squares) /
+ *                       (2 * (N - 2m) * (m * tau0)^2)
+ *
+ * where tau0 is the average time between the times. Only the last
+ * STATS_HIST times are kept. The time from the first one to the last
+ * is summed in 64 bits, since the tick count wraps around after
+ * 2^32 ticks (214 s at prescaler 1).
+ *
+ * ================================================================
+ */
+
+#define STATS_FRAC 8
+#define STATS_HIST (1 << STATS_TAUS)	/* Times kept; 2 * (largest m) */
+
+#if STATS_TAUS > 4
+#error "STATS_TAUS must be at most 4"
+#endif
+
+static unsigned long stats_n;		/* Number of measurements */
+static uint8_t stats_mode;
+static uint8_t stats_log2ne;
+static tick_t stats_end;		/* End of the latest period */
+#if STATS & STATS_MOMENTS
+static uint8_t stats_fine;		/* Frequencies in 0.1 mHz */
+static uint8_t stats_digits;		/* Significant digits */
+static unsigned long stats_ref;		/* First frequency */
+static long stats_mean;			/* Mean - stats_ref (fixed point) */
+static unsigned long long stats_m2;	/* Sum of squares (fixed point) */
+static unsigned long stats_min;
+static unsigned long stats_max;
+#endif
+#if STATS & STATS_ADEV
+static unsigned long long stats_span;	/* From the first end to the last */
+static tick_t stats_t[STATS_HIST];	/* Ends of the latest periods */
+static unsigned long long stats_sq[STATS_TAUS]; /* Sums of squares */
+#endif
+
+/*
+ * Return the 64-bit product of a and b.
+ */
+static unsigned long long mul64(unsigned long a, unsigned long b)
+{
+    unsigned long long p = 0;
+    uint8_t i;
+
+    for (i = 0; i < 32; i++) {
+	p <<= 1;
+	if (b & 0x80000000UL) {
+	    p += a;
+	}
+	b <<= 1;
+    }
+    return p;
+}
+
+static void stats_reset(void)
+{
+    stats_n = 0;
+}
+
+static void stats_add(struct measurement* m)
+{
+    uint8_t n = m->log2num_events;
+#if STATS & STATS_MOMENTS
+    unsigned long events = 1UL << n;
+    unsigned long f;
+    long x, d;
+#endif
+#if STATS & STATS_ADEV
+    tick_t t = m->end_ticks;
+    uint8_t k;
+#endif
+
+    if (m->period == MAX_PERIOD ||
+	(m->mode != MODE_SLOW && m->mode != MODE_FAST &&
+	 m->mode != MODE_REGRESSION)) {
+	stats_n = 0;
+	return;
+    }
+    if (m->mode != stats_mode || n != stats_log2ne ||
+	(m->mode != MODE_REGRESSION &&
+	 m->end_ticks - m->period != stats_end)) {
+	stats_n = 0;
+    }
+#if STATS & STATS_ADEV
+    stats_span += t - stats_end;
+#endif
+    stats_mode = m->mode;
+    stats_log2ne = n;
+    stats_end = m->end_ticks;
+
+#if STATS & STATS_MOMENTS
+    f = calc_freq(m->mode, events, m->period, 0);
+    if (stats_n == 0) {
+	stats_fine = f < FINE_LIMIT;
+    }
+    if (stats_fine) {
+	f = calc_freq(m->mode, events, m->period, 1);
+    }
+    x = f - stats_ref;
+    if (stats_n &&
+	(x >= 1L << (31 - STATS_FRAC) || x <= -(1L << (31 - STATS_FRAC)))) {
+	stats_n = 0;		/* Too far from the first one */
+    }
+    if (stats_n == 0) {
+	tick_t period = m->period;
+
+#if REGRESSION
+	if (m->mode == MODE_REGRESSION) {
+	    period /= REG_GAIN;
+	}
+#endif
+	stats_digits = count_digits(period) - 1;
+	if (stats_digits > MAX_DIGITS) {
+	    stats_digits = MAX_DIGITS;
+	}
+	stats_ref = f;
+	stats_mean = 0;
+	stats_m2 = 0;
+	stats_min = f;
+	stats_max = f;
+	x = 0;
+    }
+    if (f < stats_min) {
+	stats_min = f;
+    }
+    if (f > stats_max) {
+	stats_max = f;
+    }
+#endif
+
+#if STATS & STATS_ADEV
+    if (stats_n == 0) {
+	stats_span = 0;
+	for (k = 0; k < STATS_TAUS; k++) {
+	    stats_sq[k] = 0;
+	}
+    }
+    for (k = 0; k < STATS_TAUS; k++) {
+	uint8_t mm = 1 << k;
+	tick_t t1, t2;
+	long e;
+
+	if (stats_n < 2 * mm) {
+	    break;
+	}
+	t1 = stats_t[(stats_n - mm) & (STATS_HIST-1)];
+	t2 = stats_t[(stats_n - 2 * mm) & (STATS_HIST-1)];
+	e = (long) ((t - t1) - (t1 - t2));
+	if (e < 0) {
+	    e = -e;
+	}
+	stats_sq[k] += mul64(e, e);
+    }
+    stats_t[stats_n & (STATS_HIST-1)] = t;
+#endif
+
+    stats_n++;
+
+#if STATS & STATS_MOMENTS
+    x <<= STATS_FRAC;
+    d = x - stats_mean;
+    stats_mean += d / (long) stats_n;
+    x -= stats_mean;
+    if (d < 0) {
+	d = -d;
+	x = -x;
+    }
+    if (x > 0) {
+	stats_m2 += mul64(d, x);
+    }
+#endif
+}
+
+/*
+ * Return the integer square root of v.
+ */
+static unsigned long isqrt(unsigned long v)
+{
+    unsigned long r = 0;
+    unsigned long bit = 1UL << 30;
+
+    while (bit > v) {
+	bit >>= 2;
+    }
+    while (bit) {
+	if (v >= r + bit) {
+	    v -= r + bit;
+	    r = (r >> 1) + bit;
+	} else {
+	    r >>= 1;
+	}
+	bit >>= 2;
+    }
+    return r;
+}
+
+/*
+ * Return sqrt(sum / count) with STATS_FRAC fractional bits.
+ */
+static unsigned long stats_root_mean(unsigned long long sum,
+				     unsigned long count)
+{
+    uint8_t up = 0;
+    uint8_t down = 0;
+
+    /*
+     * Scale the sum by a power of 4, so that the quotient fits in
+     * 32 bits with as many significant bits as possible.
+     */
+    while (up < STATS_FRAC && (sum >> 62) == 0 && (sum >> 30) < count) {
+	sum <<= 2;
+	up++;
+    }
+    while ((sum >> 32) >= count) {
+	sum >>= 2;
+	down++;
+    }
+    return isqrt(div64(sum >> 32, sum, count)) << (STATS_FRAC - up + down);
+}
+
+#endif
+
+/*
+ * What is shown on each line of the display, and the DDRAM address
+ * of the cursor. On the M163, the lines follow each other in DDRAM;
+ * on the M162, the second line starts at 0x40.
+ */
+static char lcd_shown[LCD_LINES][LCD_COLS];
+static uint8_t lcd_cursor;
 
-    /*
-     * Start up in slow mode. The interrupt handler for slow
-     * mode will shift to fast mode if the frequency is too high.
-     */
+#if DOG_MODEL == DOG_LCD_M163
+#define LCD_LINE_ADDR(row) ((row) * 0x10)
+#else
+#define LCD_LINE_ADDR(row) ((row) * 0x40)
+#endif
 
-    current = &slow_cnt;
+/*
+ * Return the number of bytes needed to change line 'row' of the
+ * display into 'line' (LCD_COLS characters). Only the characters that
+ * differ from what is shown are sent. A DDRAM address command moves
+ * the cursor to the start of each run of changed characters, so that
+ * changing the last digit costs two bytes.
+ */
+static uint8_t lcd_need(uint8_t row, const char* line)
+{
+    uint8_t addr = LCD_LINE_ADDR(row);
+    uint8_t pos = lcd_cursor;
+    uint8_t need = 0;
+    uint8_t i;
+
+    for (i = 0; i < LCD_COLS; i++) {
+	if (line[i] != lcd_shown[row][i]) {
+	    need += addr + i == pos ? 1 : 2;
+	    pos = addr + i + 1;
+	}
+    }
+    return need;
 }
 
 /*
- * Interrupt service routine for the slow counting mode.
+ * Send the changes of line 'row' to the display, as counted by
+ * lcd_need(), in at most 'budget' bytes. The characters that did not
+ * fit are left for the next time.
  */
-ISR(EXT_INT0_vect)
+static void lcd_send(uint8_t row, const char* line, uint8_t budget)
 {
-    tick_t cs = cli_ticks();
-
-    if (slow_cnt.first_time) {
-	/* We can't calculate a period because it's the first time. */
-	slow_cnt.first_time = 0;
-	slow_cnt.prev_ticks = cs;
-    } else {
-	/*
-	 * Calculate the length of period that just ended. We don't need
-	 * to update log2num_events since it is always 0 (= one event).
-	 */
-	tick_t period = cs - slow_cnt.prev_ticks;
-	slow_cnt.period = period;
-	slow_cnt.prev_ticks = cs;
+    uint8_t addr = LCD_LINE_ADDR(row);
+    uint8_t i, cost;
 
-	/*
-	 * If the period is less than 100 ticks (320 us at 20Mhz), do
-	 * an emergency switch to fast counter mode. This is normally
-	 * handled by the interrupt routine for the fast mode, but if
-	 * the frequency rises quickly it might not react sufficiently
-	 * quickly. Note that the external pin interrupt has a higher
-	 * priority then any of the timer interrupts, so if the
-	 * incoming frequency is too high no other interrupt routine
-	 * than the external interrupt will ever be called.
-	 */
-	if (period < 100UL) {
-	    GIMSK = 0;
-	    fast_cnt.period = MAX_PERIOD;
-	    fast_cnt.first_time = 1;
-	    fast_cnt.current_log2num_events = 1;
-	    fast_cnt.prev_ticks = cs;
-	    OCR1A = (1 << fast_cnt.current_log2num_events) - 1;
-	    TCNT1 = 0;
-	    current = &fast_cnt;
+    for (i = 0; i < LCD_COLS; i++) {
+	if (line[i] != lcd_shown[row][i]) {
+	    cost = addr + i == lcd_cursor ? 1 : 2;
+	    if (cost > budget) {
+		return;
+	    }
+	    budget -= cost;
+	    if (cost == 2) {
+		lcd_goto(addr + i);
+	    }
+	    lcd_putc(line[i]);
+	    lcd_shown[row][i] = line[i];
+	    lcd_cursor = addr + i + 1;
 	}
     }
 }
 
 /*
- * Force switch to slow mode. Reinitialize the fast mode
- * counter to count two events.
+ * Show a line on the first line of the display. Either all changes
+ * are sent, or (if there is not room for them in the queue) none.
  */
-static void slow_mode(void)
+static void show_line(char* s)
 {
-    cli();
-    GIMSK = _BV(INT0);
-    slow_cnt.first_time = 1;
-    slow_cnt.period = MAX_PERIOD;
-    current = &slow_cnt;
-    fast_cnt.first_time = 1;
-    fast_cnt.current_log2num_events = 1;
-    set_timer_cmp_reg(fast_cnt.current_log2num_events);
-    TCNT1 = 0;
-    sei();
+    PROFILE_SCOPE(PROF_SHOW_LINE);
+    char line[LCD_COLS];
+    uint8_t i, need;
+
+    /* Pad with spaces to the width of the display. */
+    for (i = 0; i < LCD_COLS; i++) {
+	line[i] = *s ? *s++ : ' ';
+    }
+
+    need = lcd_need(0, line);
+    if (need == 0) {
+	return;			/* No change */
+    }
+    if (lcd_room() < need) {
+	return;			/* Try again next time */
+    }
+    lcd_send(0, line, need);
 }
 
-static volatile uint8_t counter_high;
-static volatile uint8_t cmp_high;
+#if HAVE_SLOW_LINES
 
-static void inline set_timer_cmp_reg(uint8_t log2ne)
+/*
+ * The most bytes that a change of the first line can need. That
+ * much room in the queue is left for it when other lines are sent.
+ */
+#define LCD_RESERVE (LCD_COLS + 1)
+
+static char lcd_wanted[LCD_LINES-1][LCD_COLS];	/* Lines 1 and up */
+static uint8_t lcd_pending;
+
+/*
+ * Set what is to be shown on line 'row' (other than the first). It
+ * is sent by lcd_flush().
+ */
+static void show_slow_line(uint8_t row, const char* s)
 {
-    if (log2ne <= 16) {
-	/*
-	 * Set up the counter from 2 up to 2^16 events.
-	 */
-	OCR1A = (1UL << log2ne) - 1;
-	cmp_high = 0;
-    } else {
-	/*
-	 * Set up our extended counter to count more than
-	 * 2^16 events.
-	 */
-	OCR1A = 0xffff;
-	cmp_high = (1 << (log2ne-16)) - 1;
-	counter_high = 0;
+    char* line = lcd_wanted[row - 1];
+    uint8_t i;
+
+    for (i = 0; i < LCD_COLS; i++) {
+	line[i] = *s ? *s++ : ' ';
     }
+    lcd_pending = 1;
 }
 
 /*
- * Desired minimum number of ticks.
+ * Send as much as there is room for of the changes to the lines
+ * other than the first. A line may be updated in several parts,
+ * since lcd_shown keeps track of what has been sent.
  */
-#define MIN_PERIOD 10000UL
+static void lcd_flush(void)
+{
+    uint8_t room, row;
+
+    if (!lcd_pending) {
+	return;
+    }
+    lcd_pending = 0;
+    for (row = 1; row < LCD_LINES; row++) {
+	room = lcd_room();
+	if (room > LCD_RESERVE) {
+	    lcd_send(row, lcd_wanted[row - 1], room - LCD_RESERVE);
+	}
+	if (lcd_need(row, lcd_wanted[row - 1])) {
+	    lcd_pending = 1;
+	}
+    }
+}
+
+#endif
 
 /*
- * Interrupt service routine for the fast counting mode.
+ * Frequency ranges. A range is used for frequencies (in Hz) from
+ * 'min' up to 'max'; the overlap between the ranges keeps the
+ * display from switching back and forth between two of them.
  */
-ISR(TIM1_COMPA_vect)
+static const struct {
+    unsigned long min;		/* Lowest value for this range */
+    unsigned long max;		/* Highest value for this range */
+    uint8_t prefix;		/* Hz prefix character (0 for none) */
+} range[] = {
+    /*            min           max  prefix */
+    {/* Hz */      0UL,        999UL,  0 },
+    {/* kHz */   990UL,     999999UL, 'k'},
+    {/* MHz */ 990000UL, 0xffffffffUL, 'M'},
+};
+static unsigned int curr_range = 0;
+static unsigned long prev_freq = 0xffffffffUL; /* Frequency shown */
+
+/*
+ * Return 'v' divided by 10^n, rounded to the nearest integer.
+ */
+static unsigned long round_digits(unsigned long v, uint8_t n)
 {
-    tick_t ticks = cli_ticks();
+    if (n == 0) {
+	return v;
+    }
+    while (--n) {
+	v /= 10;
+    }
+    return (v + 5) / 10;
+}
+
+/*
+ * Frequency in units of 10^-scale Hz (scale is 1 for dHz, 0 for Hz,
+ * or 4 for frequencies below 1kHz), rounded to 'digits' significant digits.
+ * Digits to the left of the decimal point are never dropped. If the
+ * number does not fit in front of the unit, the "Hz" is left out,
+ * and then digits are dropped until it fits. Unless 'mark' is a
+ * space, it is shown in the first column, in front of the number.
+ */
+static void display_freq(unsigned long freq, uint8_t scale, uint8_t digits,
+			 char mark)
+{
+    char line[9];
+    signed char pos;
+    uint8_t point;		/* Number of digits after the point */
+    uint8_t drop;		/* Number of digits not shown */
+    uint8_t decimals;
+    uint8_t ndigits;
+    uint8_t suffix;		/* Length of prefix + "Hz" */
+    uint8_t width;
+    uint8_t cols = mark == ' ' ? 8 : 7;
+    unsigned long v, t;
 
-    fast_wd = WD_TOP;
+    static uint8_t prev_format;
+    static char prev_mark;
+    uint8_t format = scale << 4 | digits;
+    unsigned long hz;
 
-    if (counter_high++ != cmp_high) {
-	/*
-	 * Counter set up to count more than 2^16 events
-	 * (for high frequencies).
-	 */
+    if (freq == prev_freq && format == prev_format && mark == prev_mark) {
 	return;
     }
-    counter_high = 0;
+    prev_freq = freq;
+    prev_format = format;
+    prev_mark = mark;
 
-    if (fast_cnt.first_time) {
-	/*
-	 * The very first time. We can't calculate a period.
-	 */
-	fast_cnt.first_time = 0;
-	fast_cnt.prev_ticks = ticks;
+    if (freq == 0) {
+	show_line("---");
 	return;
     }
 
     /*
-     * Calculate the result for the period that was just finished.
+     * See if we'll need to change range.
      */
-    uint8_t log2ne = fast_cnt.current_log2num_events;
-    fast_cnt.log2num_events = log2ne;
-    tick_t period = fast_cnt.period = ticks - fast_cnt.prev_ticks;
-    fast_cnt.prev_ticks = ticks;
+
+    hz = freq;
+    for (point = scale; point; point--) {
+	hz /= 10;
+    }
+    while (hz > range[curr_range].max) {
+	curr_range++;
+    }
+    while (hz < range[curr_range].min) {
+	curr_range--;
+    }
+    point = scale + 3 * curr_range;
 
     /*
-     * Now see if we should adjust the number of events we are counting
-     * for each period.
+     * Find the number of digits to drop.
      */
+    ndigits = 1;
+    for (t = freq; t >= 10; t /= 10) {
+	ndigits++;
+    }
+    drop = ndigits > digits ? ndigits - digits : 0;
+    suffix = (range[curr_range].prefix ? 1 : 0) + 2;
+    for (;;) {
+	if (drop > point) {
+	    drop = point;
+	}
+	v = round_digits(freq, drop);
+	decimals = point - drop;
+	ndigits = 1;
+	for (t = v; t >= 10; t /= 10) {
+	    ndigits++;
+	}
+	if (ndigits > digits && drop < point) {
+	    drop++;		/* Rounded up to one more digit */
+	    continue;
+	}
+	width = ndigits > decimals ? ndigits : decimals + 1;
+	if (decimals) {
+	    width++;		/* Decimal point */
+	}
+	if (width + suffix <= cols) {
+	    break;
+	} else if (suffix >= 2) {
+	    suffix -= 2;	/* Leave out "Hz" */
+	} else if (drop < point) {
+	    drop++;
+	} else {
+	    break;
+	}
+    }
 
-    if (period < MIN_PERIOD && log2ne < 20) {
-	/*
-	 * Too short period. Count more events next time.
-	 */
-	do {
-	    log2ne++;
-	    period *= 2;
-	} while (period < MIN_PERIOD && log2ne < 20);
-	set_timer_cmp_reg(log2ne);
-	GIMSK = 0;
-	current = &fast_cnt;
-	fast_cnt.current_log2num_events = log2ne;
-    } else if (period > MIN_PERIOD*3 && log2ne > 1) {
-	/*
-	 * Too long period. Count fewer events next time.
-	 */
-	do {
-	    log2ne--;
-	    period /= 2;
-	} while (period > MIN_PERIOD*3 && log2ne > 1);
-	set_timer_cmp_reg(log2ne);
-	fast_cnt.current_log2num_events = log2ne;
+    /*
+     * Now format the frequency, starting with the unit.
+     */
+    line[8] = '\0';
+    pos = 7;
+    if (suffix >= 2) {
+	line[pos--] = 'z';
+	line[pos--] = 'H';
+    }
+    if (suffix & 1) {
+	line[pos--] = range[curr_range].prefix;
+    }
+
+    /* Format digits to the right of the decimal point */
+    while (decimals--) {
+	line[pos--] = v % 10 + '0';
+	v /= 10;
+	if (decimals == 0) {
+	    line[pos--] = '.';
+	}
+    }
+
+    /*
+     * Fill in at least one digit to the left of the decimal
+     * point.
+     */
+    do {
+	line[pos--] = v % 10 + '0';
+	v /= 10;
+    } while (v);
+
+    /* Out of significant digits. Fill in spaces. */
+    while (pos >= 0) {
+	line[pos--] = ' ';
+    }
+    if (mark != ' ') {
+	line[0] = mark;
+    }
+
+    show_line(line);
+}
+
+/*
+ * Show a text instead of the frequency.
+ */
+static void show_text(const char* s)
+{
+    show_line((char *) s);
+
+    /* The frequency must be shown again when we are done. */
+    prev_freq = 0xffffffffUL;
+}
+
+#if DUTY || RATIO || CALIBRATE || STATS
+
+/*
+ * Format a label in the first column (unless it is 0) and the number
+ * v (with the given number of decimals) followed by the suffix at
+ * the right, in the eight characters of 'line', which is terminated.
+ */
+static void format_number(char* line, char label, unsigned long v,
+			  uint8_t decimals, const char* suffix)
+{
+    signed char pos = 8 - strlen(suffix);
+
+    memset(line, ' ', 8);
+    if (label) {
+	line[0] = label;
+    }
+    memcpy(line + pos, suffix, 8 - pos);
+    line[8] = '\0';
+    while (pos > (label != 0)) {
+	line[--pos] = v % 10 + '0';
+	v /= 10;
+	if (decimals && --decimals == 0 && pos) {
+	    line[--pos] = '.';
+	}
+	if (v == 0 && decimals == 0 && line[pos] != '.') {
+	    break;
+	}
+    }
+}
+
+/*
+ * Show a number as formatted by format_number().
+ */
+static void show_number(char label, unsigned long v, uint8_t decimals,
+			const char* suffix)
+{
+    char line[9];
+
+    format_number(line, label, v, decimals, suffix);
+    show_text(line);
+}
+
+#endif
+
+#if DUTY
+
+/*
+ * Show a label and the average length of 'sum' ticks over
+ * 2^log2n cycles, with four digits and a unit from ns to s.
+ */
+static void show_time(char label, tick_t sum, uint8_t log2n)
+{
+    static const char units[4][3] = { "ns", "us", "ms", "s" };
+    unsigned long mul = 3906250UL;	/* 10^9 / 256 (ns) */
+    unsigned long div = TICK_HZ;
+    unsigned long v;
+    uint8_t unit = 0;
+    uint8_t k;
+
+    /*
+     * The time is sum * 10^9 / (TICK_HZ * 2^log2n) ns. Times of
+     * 4 s or more don't fit, so calculate them in us.
+     */
+    if ((sum >> log2n) >= 4 * TICK_HZ) {
+	mul = 15625;			/* 10^6 / 256 * 4 (us) */
+	div = 4 * TICK_HZ;
+	unit = 1;
+    }
+    if (log2n > 8) {
+	sum >>= log2n - 8;
+	log2n = 8;
+    }
+    v = mul_div(sum, mul, 8 - log2n, div);
+
+    k = count_digits(v);
+    if (k > 4) {
+	v = round_digits(v, k - 4);
+	if (v == 10000) {
+	    v = 1000;		/* Rounded up to one more digit */
+	    k++;
+	}
+    }
+    unit += (k - 1) / 3;
+    if (unit > 3) {
+	show_number(label, 9999, 0, "s");
+	return;
     }
+    show_number(label, v, (k < 4 ? k : 4) - 1 - (k - 1) % 3, units[unit]);
+}
+
+/*
+ * Show the duty cycle, high time, or low time, calculated from the
+ * total high time and the total period of the same cycles.
+ */
+static void duty_show(struct measurement* high, struct measurement* p)
+{
+    static const char labels[DUTY_VIEWS] = { 'D', 'H', 'L' };
+
+    if (p->period == MAX_PERIOD || high->end_ticks != p->end_ticks ||
+	high->log2num_events != p->log2num_events) {
+	char line[9];
+
+	memcpy(line, "?    ---", sizeof(line));
+	line[0] = labels[duty_view];
+	show_text(line);
+	return;
+    }
+    switch (duty_view) {
+    case DUTY_VIEW_DUTY:
+	{
+	    unsigned long d = mul_div(high->period, 10000, 0, p->period);
+	    if (d >= 10000) {
+		show_number('D', 1000, 1, "%");	/* 100.0% */
+	    } else {
+		show_number('D', d, 2, "%");
+	    }
+	}
+	break;
+    case DUTY_VIEW_HIGH:
+	show_time('H', high->period, p->log2num_events);
+	break;
+    default:
+	show_time('L', p->period - high->period, p->log2num_events);
+	break;
+    }
+}
+
+#endif
+
+#if RATIO
+
+/*
+ * Show the ratio A/B, with as many digits as the count of A has
+ * (at most 7).
+ */
+static void ratio_show(struct measurement* m)
+{
+    unsigned long count = m->period;
+    unsigned long n = 1UL << m->log2num_events;
+    unsigned long p10 = 1;
+    uint8_t digits;
+    uint8_t decimals;
+
+    if (m->mode != MODE_RATIO || count == MAX_PERIOD) {
+	show_text("     ---");
+	return;
+    }
+    if (count == 0) {
+	show_number(0, 0, 0, "");
+	return;
+    }
+    digits = count_digits(count);
+    if (digits > 7) {
+	digits = 7;
+    }
+    if (count >= n) {
+	uint8_t k = count_digits(count / n);
+	if (k > 8) {
+	    show_text("Overflow");
+	    return;
+	}
+	decimals = digits > k ? digits - k : 0;
+    } else {
+	/* Add the zeroes after the decimal point; leave room for "0." */
+	decimals = count_digits((n - 1) / count) - 1 + digits;
+	if (decimals > 6) {
+	    decimals = 6;
+	}
+    }
+    for (n = 0; n < decimals; n++) {
+	p10 *= 10;
+    }
+    show_number(0, mul_div(count, p10, 0, 1UL << m->log2num_events),
+		decimals, "");
+}
+
+#endif
 
-    /*
-     * Check if we should change mode.
-     */
+#if CALIBRATE
 
-    if (current == &fast_cnt) {
-	if (period > MIN_PERIOD*3 && log2ne == 1) {
-	    /*
-	     * Too long period. Switch to slow mode.
-	     */
-	    GIMSK = _BV(INT0);
-	    slow_cnt.period = period / 2;
-	    slow_cnt.prev_ticks = ticks;
-	    slow_cnt.first_time = 1;
-	    current = &slow_cnt;
+/*
+ * Show the deviation of the tick frequency from TICK_HZ found by the
+ * latest calibration, in ppm. Until there is one, show how many
+ * seconds of the 1PPS signal have been measured.
+ */
+static void cal_show(void)
+{
+    unsigned long v;
+    char sign = '+';
+
+    if (!cal_result) {
+	char line[9] = "PPS  ---";
+	unsigned s = cal_seconds;
+	uint8_t pos = 7;
+
+	if (s) {
+	    memcpy(line + 5, "  s", 3);
+	    do {
+		line[--pos] = s % 10 + '0';
+		s /= 10;
+	    } while (s);
 	}
-    } else if (slow_cnt.period < MIN_PERIOD) {
-	/*
-	 * Running too fast for slow mode. Switch to fast mode.
-	 */
-	GIMSK = 0;
-	current = &fast_cnt;
+	show_text(line);
+	return;
+    }
+    if (cal_result >= CAL_NOMINAL) {
+	v = cal_result - CAL_NOMINAL;
+    } else {
+	v = CAL_NOMINAL - cal_result;
+	sign = '-';
+    }
+    v = mul_div(v, 10000000UL, 0, CAL_NOMINAL);	/* 0.1 ppm */
+    if (v >= 1000) {
+	show_number(sign, (v + 5) / 10, 0, "ppm");
+    } else {
+	show_number(sign, v, 1, "ppm");
     }
 }
 
-/* ================================================================
- *
- * Display the frequency from the last measurement.
- *
- * ================================================================
- */
+#endif
+
+#if STATS
 
-static void display_measurement(uint8_t n, tick_t ticks)
+/*
+ * Format v, in units of 10^-12, with two significant digits and no
+ * decimal point at the end of the eight characters of 'line', for
+ * example "34E-8" (3.4 * 10^-7). From 10^-10 and down there is only
+ * room for one digit ("3E-10"). If v is 0xffffffff, the line is left
+ * as it is.
+ */
+static void format_e12(char* line, unsigned long v)
 {
-    unsigned long f = 0;
+    uint8_t digits = count_digits(v);
+    uint8_t e = 12;		/* Exponent (negated) */
+    char* p = line + 8;
 
-    if (ticks == 0) {
-	show_line("---");
-    } else {
-	/*
-	 * Here we want to calculate the frequency in dHz
-	 * (tenths of Hz). We use dHz instead of Hz so that
-	 * we don't have to use any floating point arithmetics.
-	 *
-	 * The frequency expressed in ticks is (1 << n) / ticks.
-	 * To get the frequency in Hz we must multiply by the
-	 * tick frequency, which is F_CPU / 64. To get dHz we
-	 * must multiply by 10. That is, the frequency in dHz
-	 * is:
-	 *
-	 *    10 * F_CPU / 64 * (1 << n) / ticks
-	 *
-	 * or
-	 *
-	 *    (10 * F_CPU / 64) << n / ticks
-	 *
-	 * To round up to the nearest dHz, we first add ticks / 2
-	 * before the division. Thus the final formula is:
-	 *
-	 *    (((10 * F_CPU / 64) << n) + ticks / 2) / ticks
-	 *
-	 */
-	if (n < 11) {
-	    /*
-	     * If F_CPU is 20Mhz, the largest n that will not
-	     * overflow a 32 bit unsigned integer is 10:
-	     *
-	     *  10*20000000/64 << 10 = 0xBEBC2000
-	     *
-	     * Using 32-bit arithmetic for this formula is
-	     * more than 3 times faster than 64-bit arithmetic.
-	     */
-	    f = (((10UL*F_CPU/64) << n) + ticks/2) / ticks;
-	} else {		/* n >= 11 */
-	    /*
-	     * Do the arithmethic in 64 bits to avoid overflow.
-	     */
-	    unsigned long long events = ((10ULL * F_CPU/64) << n);
-	    f = (events + ticks/2) / ticks;
+    if (v == 0xffffffffUL) {
+	return;
+    }
+    if (digits > 2) {
+	v = round_digits(v, digits - 2);
+	e -= digits - 2;
+	if (v == 100) {
+	    v = 10;
+	    e--;
+	}
+    }
+    if (e >= 10 && v >= 10) {
+	v = (v + 5) / 10;
+	e--;
+	if (v == 10) {
+	    v = 1;
+	    e--;
 	}
-	display_freq(f);
     }
+    *--p = e % 10 + '0';
+    if (e >= 10) {
+	*--p = e / 10 + '0';
+    }
+    *--p = '-';
+    *--p = 'E';
+    do {
+	*--p = v % 10 + '0';
+	v /= 10;
+    } while (v);
 }
 
-static void show_line(char* s)
+#if STATS & STATS_MOMENTS
+/*
+ * Return the mean frequency, rounded.
+ */
+static unsigned long stats_mean_freq(void)
 {
-    int i;
-    static char prev_line[9];
+    return stats_ref + ((stats_mean + (1L << (STATS_FRAC - 1))) >>
+			STATS_FRAC);
+}
+#endif
 
-    if (strcmp(s, prev_line) == 0) {
-	return;			/* No change */
-    }
+#if STATS & STATS_ADEV
+/*
+ * Return the Allan deviation for tau = 2^k times the measurement
+ * period, in units of 10^-12, or 0xffffffff if there are not enough
+ * measurements or it is too large.
+ */
+static unsigned long stats_adev(uint8_t k)
+{
+    uint8_t m = 1 << k;
+    unsigned long tau0, r;
 
-    lcd_home();
-    for (i = 0; i < 8 && s[i]; i++) {
-	prev_line[i] = s[i];
-	lcd_putc(s[i]);
-    }
-    prev_line[i] = '\0';
-    while (i < 8) {
-	lcd_putc(' ');
-	i++;
+    if (stats_n <= 2 * m) {
+	return 0xffffffffUL;
     }
+    tau0 = div64(stats_span >> 32, stats_span, stats_n - 1);
+    r = stats_root_mean(stats_sq[k], 2 * (stats_n - 2 * m));
+    return mul_div(r, 1000000000000ULL >> STATS_FRAC, 0, m * tau0);
 }
 
 /*
- * Frequency ranges.
+ * Show the Allan deviation for tau = 2^k times the measurement
+ * period, for example "A2 34E-8".
  */
-static struct {
-    unsigned long min;		/* Lowest value for this range */
-    unsigned long max;		/* Highest value for this range */
-    signed char point;		/* Position of decimal point */
-    signed char lsd;		/* Position of least significant digit */
-    unsigned int divisor;	/* Divisor */
-    uint8_t prefix;		/* Hz prefix character */
-} range[] = {
-    /*  01234567         min         max   . lsd   div  prefix */
-    {/*  999.9Hz */       0UL,     9999UL, 4, 5,     1, ' '},
-    {/* 9.999kHz */    9900UL,    99999UL, 1, 4,    10, 'k'},
-    {/* 99.99kHz */   99000UL,   999999UL, 2, 4,   100, 'k'},
-    {/* 999.9kHz */  990000UL,  9999999UL, 3, 4,  1000, 'k'},
-    {/* 9.999MHz */ 9900000UL, 99999999UL, 1, 4, 10000, 'M'},
-};
-static unsigned int curr_range = 0;
+static void stats_show_adev(uint8_t k)
+{
+    char line[9] = "A    ---";
+
+    line[1] = '0' + (1 << k);
+    format_e12(line, stats_adev(k));
+    show_text(line);
+}
+#endif
 
-/* Frequency in dHz (10dHz = 1Hz). */
-static void display_freq(unsigned long freq)
+/*
+ * Show a page of statistics: the number of measurements, then
+ * (STATS_MOMENTS) the mean ("="), the standard deviation ("s"), the
+ * minimum ("L"), and the maximum ("H"), then (STATS_ADEV) the Allan
+ * deviations.
+ */
+static void stats_show(uint8_t page)
 {
-    char line[9];
-    signed char pos;
-    signed char point;
-    static unsigned long prev_freq = 0xffffffffUL;
+#if STATS & STATS_MOMENTS
+    uint8_t scale = stats_fine ? 4 : FREQ_DECIMALS;
+    unsigned long v;
+#endif
 
-    if (freq == prev_freq) {
+    if (page == 0) {
+	show_number('N', stats_n, 0, "");
 	return;
     }
-    prev_freq = freq;
-
-    if (freq == 0) {
-	show_line("---");
+    page--;
+#if STATS & STATS_MOMENTS
+    if (page < 4) {
+	if (stats_n < 1 + (page == 1)) {
+	    show_text("     ---");
+	    return;
+	}
+	switch (page) {
+	case 0:
+	    display_freq(stats_mean_freq(), scale, stats_digits, '=');
+	    break;
+	case 1:
+	    /* Three digits, in units of 10^-(scale+2) Hz */
+	    v = mul_div(stats_root_mean(stats_m2, stats_n - 1), 100, 0,
+			1UL << (2 * STATS_FRAC));
+	    if (v == 0) {
+		show_number('s', 0, 0, "Hz");
+	    } else {
+		display_freq(v, scale + 2, 3, 's');
+	    }
+	    break;
+	case 2:
+	    display_freq(stats_min, scale, stats_digits, 'L');
+	    break;
+	default:
+	    display_freq(stats_max, scale, stats_digits, 'H');
+	    break;
+	}
 	return;
     }
+    page -= 4;
+#endif
+#if STATS & STATS_ADEV
+    stats_show_adev(page);
+#endif
+}
 
-    /*
-     * See if we'll need to change range.
-     */
+#if HAVE_LINE_STATS
+/*
+ * Show the statistics line: the number of measurements, and the
+ * Allan deviation for tau0 (STATS_ADEV) or else the standard
+ * deviation relative to the mean, for example "N   1234A1 13E-5".
+ */
+static void stats_show_line(void)
+{
+    char line[17];
+#if !(STATS & STATS_ADEV)
+    unsigned long v = 0xffffffffUL;
+    unsigned long mean = stats_mean_freq();
+#endif
 
-    while (freq > range[curr_range].max) {
-	curr_range++;
-    }
-    while (freq < range[curr_range].min) {
-	curr_range--;
+    format_number(line, 'N', stats_n, 0, "");
+#if STATS & STATS_ADEV
+    memcpy(line + 8, "A1   ---", 9);
+    format_e12(line + 8, stats_adev(0));
+#else
+    memcpy(line + 8, "s    ---", 9);
+    if (stats_n >= 2 && mean) {
+	/* m2 has 2 * STATS_FRAC fractional bits, and so has its root */
+	v = mul_div(stats_root_mean(stats_m2, stats_n - 1),
+		    1000000000000ULL >> (2 * STATS_FRAC), 0, mean);
     }
+    format_e12(line + 8, v);
+#endif
+    show_slow_line(LINE_STATS, line);
+}
+#endif
 
-    /*
-     * Now format the frequency within the range.
-     *
-     * First set up the end of the line (prefix + "Hz").
-     */
-
-    line[5] = range[curr_range].prefix;
-    line[6] = 'H';
-    line[7] = 'z';
-    line[8] = '\0';
+#endif
 
-    pos = range[curr_range].lsd;
-    point = range[curr_range].point;
-    freq /= range[curr_range].divisor;
+#if HAVE_LINE_STATUS
+/*
+ * Show the status line: the measurement mode (or the name of the
+ * selected function), the number of events per measurement, and the
+ * gate profile, for example "Fast 2^12 Normal".
+ */
+static void show_status(const char* name, struct measurement* m)
+{
+    static const char mode_names[][5] = { "Slow", "Fast", "Reg" };
+    char line[LCD_COLS + 1];
+    const char* gate_name = gates[gate].name;
+    uint8_t n = m->log2num_events;
+    char* p = line + 5;
 
-    /* Format digits to the right of the decimal point */
-    while (pos > point) {
-	line[pos--] = freq % 10 + '0';
-	freq /= 10;
+    memset(line, ' ', LCD_COLS);
+    line[LCD_COLS] = '\0';
+    if (name == 0) {
+	if (m->mode <= MODE_REGRESSION) {
+	    memcpy(line, mode_names[m->mode], strlen(mode_names[m->mode]));
+	}
+	if (m->period != MAX_PERIOD) {
+	    *p++ = '2';
+	    *p++ = '^';
+	    if (n >= 10) {
+		*p++ = n / 10 + '0';
+	    }
+	    *p = n % 10 + '0';
+	}
+    } else {
+	memcpy(line, name, strlen(name));
     }
+    memcpy(line + LCD_COLS - strlen(gate_name), gate_name,
+	   strlen(gate_name));
+    show_slow_line(LINE_STATUS, line);
+}
+#endif
 
-    /*
-     * Fill in the decimal point and one digit to the left
-     * of the decimal point.
-     */
-    line[pos--] = '.';
-    line[pos--] = freq % 10 + '0';
-    freq /= 10;
+#if INSTRUMENT
+/*
+ * Show a page of statistics, as a label followed by a number.
+ */
+static void instr_show(uint8_t page)
+{
+    static const char labels[INSTR_PAGES][5] = {
+	"sLat", "sDur", "fLat", "fDur", "dDur", "tLat",
+	"Pend", "Nest", "Lost", "Emrg", "Ovrn",
+    };
+    char line[9];
+    unsigned v;
+    signed char pos;
 
-    /* Fill in non-zero digits to the left of the decimal point. */
-    while (freq) {
-	line[pos--] = freq % 10 + '0';
-	freq /= 10;
+    cli();
+    switch (page) {
+    case 0: v = instr_slow.latency; break;
+    case 1: v = instr_slow.duration; break;
+    case 2: v = instr_fast.latency; break;
+    case 3: v = instr_fast.duration; break;
+    case 4: v = instr_dog.duration; break;
+    case 5: v = instr_time_latency; break;
+    case 6: v = instr_max_pending; break;
+    case 7: v = instr_max_depth; break;
+    case 8: v = instr_lost_ovf; break;
+    case 9: v = instr_emergency; break;
+    default: v = meas_overruns; break;
     }
+    sei();
 
-    /* Out of significant digits. Fill in spaces. */
-    while (pos >= 0) {
-	line[pos--] = ' ';
+    if (v > 9999) {
+	v = 9999;
     }
-
-    show_line(line);
+    memcpy(line, labels[page], 4);
+    for (pos = 7; pos >= 4; pos--) {
+	line[pos] = v || pos == 7 ? v % 10 + '0' : ' ';
+	v /= 10;
+    }
+    line[8] = '\0';
+    show_text(line);
 }
+#endif
 
 /* ================================================================
  * DOG display support.
  * ================================================================
  */
 
+#define DOG_LCD_CONTRAST 0x28	/* Default for the configuration */
+
 /*
- * Define the different display models.
- *
- * M081 1 line by 8 chars.
- * M162 2 lines by 16 chars.
- * M163 3 lines by 16 chars.
+ * The display must have had power for 40 ms before it is set up.
  */
+#define DOG_POWER_UP_MS 40
 
-#define DOG_LCD_M081 81
-#define DOG_LCD_M162 82
-#define DOG_LCD_M163 83
-#define DOG_MODEL DOG_LCD_M081
-
-#define DOG_LCD_CONTRAST 0x28
+/*
+ * Select how bytes are shifted out to the display.
+ *
+ * 0 Bit-bang all signals (SI on PA0).
+ * 1 Use the USI in three-wire mode. The USI shift register drives
+ *   SI from its DO pin (PA5), freeing PA0. The USI clock pin USCK is
+ *   PA4, which is also the T1 input, so the display clock stays on
+ *   PA1 and is toggled in software.
+ */
+#define DOG_SPI_USI 0
 
 /*
  * All pins for the DOG display must be connected to the same port.
@@ -661,14 +5002,27 @@ static void display_freq(unsigned long freq)
 #define DOG_PIN PINA
 #define DOG_PORT PORTA
 
+#if DOG_SPI_USI
+#define DOG_SI_BIT  PA5		/* USI DO */
+#else
 #define DOG_SI_BIT  PA0
+#endif
 #define DOG_CLK_BIT PA1
 #define DOG_CSB_BIT PA2
+#if ENGINE_ICP
+#define DOG_RS_BIT  PA4		/* PA3 is the T0 input */
+#else
 #define DOG_RS_BIT  PA3
+#endif
+
+#if DOG_SPI_USI && DEBUG
+#error "DEBUG uses PA5, which is the USI DO pin when DOG_SPI_USI is enabled"
+#endif
 
 #define DOG_ALL_BITS (_BV(DOG_SI_BIT) | _BV(DOG_CLK_BIT) | _BV(DOG_CSB_BIT) | _BV(DOG_RS_BIT))
 
 static void spi_transfer(uint8_t value);
+static void lcd_enqueue(uint8_t value, uint8_t data);
 static void set_instruction_set(uint8_t is);
 static inline void write_command(uint8_t value, unsigned execution_time)
     __attribute__ ((always_inline));
@@ -678,18 +5032,31 @@ static inline void execute(uint8_t value, unsigned execution_time)
 
 static void lcd_init(void)
 {
+    /*
+     * The first measurement is already being taken while we wait.
+     */
+    _delay_ms(DOG_POWER_UP_MS);
+
     DOG_DDR |= DOG_ALL_BITS;
     DOG_PORT |= DOG_ALL_BITS;
+#if DOG_SPI_USI
+    /* Three-wire mode, shifted by software clock strobes. */
+    USICR = _BV(USIWM0);
+#endif
 
     /* The commands that follow are in instruction set 1. */
     set_instruction_set(1);
 
-    /* Bias 1/4. */
+    /* Bias 1/4. The lowest bit (FX) must be 0 for two lines. */
+#if DOG_MODEL == DOG_LCD_M162
+    write_command(0x1C, 30);
+#else
     write_command(0x1D, 30);
+#endif
 
     /* Set up contrast. (For 5V.) */
-    write_command(0x50 | (DOG_LCD_CONTRAST>>4), 30);
-    write_command(0x70 | (DOG_LCD_CONTRAST & 0x0F), 30);
+    write_command(0x50 | (config.contrast>>4), 30);
+    write_command(0x70 | (config.contrast & 0x0F), 30);
 
     /* Set amplification ratio for the follower control. */
     write_command(0x69, 30);
@@ -707,15 +5074,160 @@ static void lcd_init(void)
     write_command(0x08 | 0x04, 30);
 }
 
-static void lcd_home(void)
+/*
+ * Queue for commands and characters sent to the display after
+ * initialization. The bytes are sent from the compare match A
+ * interrupt of the timer that counts ticks, with the next compare
+ * match scheduled when the display controller has finished executing
+ * the previous byte. Therefore, no one has to wait for the display.
+ */
+
+/* Must be a power of two and hold a full line plus one command. */
+#if LCD_COLS > 8
+#define DOG_QUEUE_SIZE 32
+#else
+#define DOG_QUEUE_SIZE 16
+#endif
+
+/*
+ * The timer used for pacing the queue is the one that keeps the time.
+ */
+#if ENGINE_ICP
+#define DOG_TCNT TCNT1
+#define DOG_OCR OCR1A
+#define DOG_TIMSK TIMSK1
+#define DOG_OCIE OCIE1A
+#define DOG_TIFR TIFR1
+#define DOG_OCF OCF1A
+#define DOG_vect TIM1_COMPA_vect
+#define DOG_TIMER_BITS 16
+#else
+#define DOG_TCNT TCNT0
+#define DOG_OCR OCR0A
+#define DOG_TIMSK TIMSK0
+#define DOG_OCIE OCIE0A
+#define DOG_TIFR TIFR0
+#define DOG_OCF OCF0A
+#define DOG_vect TIM0_COMPA_vect
+#define DOG_TIMER_BITS 8
+#endif
+
+/*
+ * Convert an execution time in us to ticks, rounding up.
+ */
+#define DOG_TICKS(us) (US_TO_TICKS(us) + 1)
+
+static volatile struct {
+    uint8_t value;
+    uint8_t data;		/* 1 = character, 0 = command */
+} dog_queue[DOG_QUEUE_SIZE];
+static volatile uint8_t dog_head;	/* Written by lcd_enqueue() */
+static volatile uint8_t dog_tail;	/* Written by the interrupt */
+static volatile uint8_t dog_idle = 1;	/* Queue empty; nothing scheduled */
+#if DOG_TIMER_BITS == 8
+static uint8_t dog_rounds;		/* Whole timer periods to wait */
+#endif
+
+static void lcd_enqueue(uint8_t value, uint8_t data)
+{
+    uint8_t head = dog_head;
+
+    dog_queue[head].value = value;
+    dog_queue[head].data = data;
+    dog_head = (head + 1) & (DOG_QUEUE_SIZE-1);
+
+    /*
+     * Start the interrupt if it was idle. (The interrupt routine
+     * turns itself off when it finds the queue empty, or just keeps
+     * waking up the main loop with ENGINE_ICP.)
+     */
+    cli();
+    if (dog_idle) {
+	dog_idle = 0;
+	DOG_OCR = DOG_TCNT + 2;
+	DOG_TIFR = _BV(DOG_OCF);
+	DOG_TIMSK |= _BV(DOG_OCIE);
+    }
+    sei();
+}
+
+/*
+ * Return the number of bytes that can be queued without overwriting
+ * bytes that have not been sent yet.
+ */
+static uint8_t lcd_room(void)
+{
+    return (dog_tail - dog_head - 1) & (DOG_QUEUE_SIZE-1);
+}
+
+/*
+ * Send the next byte from the queue. Other interrupts are allowed
+ * while the byte is being sent, but this one is masked until the
+ * next compare match has been scheduled: the byte takes longer than
+ * a lap of timer 0 at prescaler 1 (256 cycles), so the old compare
+ * value would match again and re-enter the routine.
+ */
+ISR(DOG_vect)
+{
+    uint8_t tail;
+    uint8_t value;
+    unsigned wait;
+
+#if DOG_TIMER_BITS == 8
+    if (dog_rounds) {
+	dog_rounds--;
+	return;
+    }
+#endif
+
+    tail = dog_tail;
+    if (tail == dog_head) {
+	dog_idle = 1;
+#if ENGINE_ICP
+	DOG_OCR = DOG_TCNT + WAKE_INTERVAL;
+#else
+	DOG_TIMSK &= ~_BV(DOG_OCIE);
+#endif
+	return;
+    }
+
+    DOG_TIMSK &= ~_BV(DOG_OCIE);
+    sei();
+
+    PROFILE_SCOPE(PROF_DOG);
+    INSTR_SCOPE(instr_dog);
+    value = dog_queue[tail].value;
+    if (dog_queue[tail].data) {
+	DOG_PORT |= _BV(DOG_RS_BIT);
+	wait = DOG_TICKS(30);
+    } else {
+	DOG_PORT &= ~_BV(DOG_RS_BIT);
+	/* Clear display and return home take 1.1 ms. */
+	wait = value < 0x04 ? DOG_TICKS(1100) : DOG_TICKS(30);
+    }
+    spi_transfer(value);
+    dog_tail = (tail + 1) & (DOG_QUEUE_SIZE-1);
+
+    cli();
+#if DOG_TIMER_BITS == 8
+    dog_rounds = wait >> 8;
+#endif
+    DOG_OCR = DOG_TCNT + wait;
+    DOG_TIFR = _BV(DOG_OCF);
+    DOG_TIMSK |= _BV(DOG_OCIE);
+}
+
+/*
+ * Move the cursor to DDRAM address 'addr' (see LCD_LINE_ADDR).
+ */
+static void lcd_goto(uint8_t addr)
 {
-    write_command(0x80, 30);
+    lcd_enqueue(0x80 | addr, 0);
 }
 
 static void lcd_putc(char c)
 {
-    DOG_PORT |= _BV(DOG_RS_BIT);
-    execute((uint8_t) c, 30);
+    lcd_enqueue((uint8_t) c, 1);
 }
 
 /*
@@ -743,6 +5255,38 @@ static void inline execute(uint8_t value, unsigned execution_time)
     _delay_us(execution_time);
 }
 
+#if DOG_SPI_USI
+
+/*
+ * Each USICLK strobe shifts USIDR one step, putting the next bit
+ * on DO, and advances the USI 4-bit counter. The counter is
+ * preloaded so that it overflows after the eighth strobe. The
+ * display samples SI on the rising edge of CLK.
+ *
+ * CLK is held low for 1 us, as in the bit-banged version below, so
+ * that the clock pulses are as wide as they have always been. A byte
+ * takes about 250 cpu cycles (13 us at 20Mhz), compared to about 350
+ * cycles (18 us) for the bit-banged version, which also has to test
+ * and set SI for each bit. (These are estimates from the
+ * instructions; "make profile-run" measures the interrupt routine
+ * that calls this.)
+ */
+static void spi_transfer(uint8_t value)
+{
+    USIDR = value;
+    USISR = _BV(USIOIF) | 8;
+    DOG_PORT &= ~_BV(DOG_CSB_BIT);
+    do {
+	DOG_PIN |= _BV(DOG_CLK_BIT);
+	_delay_us(1);
+	DOG_PIN |= _BV(DOG_CLK_BIT);
+	USICR = _BV(USIWM0) | _BV(USICLK);
+    } while ((USISR & _BV(USIOIF)) == 0);
+    DOG_PORT |= _BV(DOG_CSB_BIT);
+}
+
+#else
+
 static void spi_transfer(uint8_t value)
 {
     int i;
@@ -761,3 +5305,67 @@ static void spi_transfer(uint8_t value)
     }
     DOG_PORT |= _BV(DOG_CSB_BIT);
 }
+
+#endif
+
+/* ================================================================
+ *
+ * Configuration.
+ *
+ * The configuration is kept in the EEPROM as a struct config, which
+ * starts with CONFIG_VERSION and ends with a checksum. If either is
+ * wrong (in an erased EEPROM, or after a new program has changed the
+ * layout), the defaults from the options above are used instead.
+ * Each field is also checked on its own, so that a value out of
+ * range does no harm. When a setting is changed, config_save()
+ * writes the bytes that differ.
+ *
+ * ================================================================
+ */
+
+#define CONFIG_VERSION 1	/* Increment when the layout changes */
+
+static struct config EEMEM eeprom_config;
+
+static uint8_t config_sum(void)
+{
+    uint8_t* p = (uint8_t *) &config;
+    uint8_t sum = 0;
+    uint8_t i;
+
+    for (i = 0; i < sizeof(config); i++) {
+	sum += p[i];
+    }
+    return sum;
+}
+
+static void config_load(void)
+{
+    eeprom_read_block(&config, &eeprom_config, sizeof(config));
+    if (config.version != CONFIG_VERSION || config_sum() != 0) {
+	config.version = CONFIG_VERSION;
+	config.gate = GATE_DEFAULT;
+	config.filter_depth = 0;	/* FILTER_DEPTH */
+	config.contrast = DOG_LCD_CONTRAST;
+	config.prescaler = INPUT_PRESCALER;
+	config.cal_ticks = 0;		/* Not calibrated */
+    }
+    if (config.gate >= NUM_GATES) {
+	config.gate = GATE_DEFAULT;
+    }
+#if FILTER
+    if (config.filter_depth == 0 || config.filter_depth > FILTER_DEPTH) {
+	config.filter_depth = FILTER_DEPTH;
+    }
+#endif
+    config.contrast &= 0x3f;
+    if (config.prescaler == 0) {
+	config.prescaler = 1;
+    }
+}
+
+static void config_save(void)
+{
+    config.checksum -= config_sum();
+    eeprom_update_block(&config, &eeprom_config, sizeof(config));
+}
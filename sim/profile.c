@@ -0,0 +1,261 @@
+/*
+ *    Frequency counter for ATTiny84A
+ *    Copyright (C) 2014  Bjorn Gustavsson
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Run main-profile.elf (see "make profile") in simavr with a square
+ * wave on the input, and print how many cycles each routine took.
+ *
+ *    profile [-icp] [-s seconds] main-profile.elf frequency...
+ *
+ * Each frequency (in Hz) is applied for the given number of seconds
+ * of simulated time (2 by default), in order. The input is PB2 and
+ * PA4, or PA3 with -icp (for ENGINE_ICP 1, where PB2 is also
+ * connected to PA7 as on the board).
+ *
+ * The program writes the id of the running routine (PROF_* in main.c)
+ * to GPIOR0, and restores the previous id when the routine is done.
+ * Every write is seen here: a write of the id just below the top of
+ * the stack ends the routine at the top, and any other id starts a
+ * new one. The cycles between two writes belong to the routine at
+ * the top (exclusive time); the cycles from the start to the end of
+ * a routine, including the interrupts it was interrupted by, are its
+ * inclusive time. The few cycles of an interrupt routine before it
+ * writes its id are counted for the routine that was interrupted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_io.h"
+#include "sim_cycle_timers.h"
+#include "avr_ioport.h"
+
+#define GPIOR0_ADDR 0x33	/* I/O address 0x13 in data space */
+#define NUM_IDS 16
+#define MAX_DEPTH 8
+
+static const char* names[NUM_IDS] = {
+    "sleep", "main", "time", "slow", "fast", "dog", "display",
+    "show_line", "serial", "duty",
+};
+
+static struct {
+    unsigned long count;	/* Number of times started */
+    avr_cycle_count_t excl;	/* Total exclusive cycles */
+    avr_cycle_count_t incl;	/* Total inclusive cycles */
+    avr_cycle_count_t max_incl;	/* Longest single run */
+} stats[NUM_IDS];
+
+static struct {
+    uint8_t id;
+    avr_cycle_count_t start;
+} stack[MAX_DEPTH] = { { 0, 0 } };
+static int depth = 1;
+static avr_cycle_count_t last;	/* Cycle of the latest write */
+static int overflows;
+
+static avr_irq_t* inputs[2];
+static double half_period;	/* In cycles */
+static double next_edge;
+static uint32_t level = 1;
+
+/*
+ * Start counting again. A routine that is running now keeps its
+ * place on the stack, but only its time from now on is counted.
+ */
+static void clear_stats(avr_cycle_count_t now)
+{
+    int i;
+
+    memset(stats, 0, sizeof(stats));
+    for (i = 0; i < depth; i++) {
+	stack[i].start = now;
+    }
+    last = now;
+}
+
+static void gpior0_write(struct avr_t* avr, avr_io_addr_t addr, uint8_t v,
+			 void* param)
+{
+    avr_cycle_count_t now = avr->cycle;
+    uint8_t top = stack[depth-1].id;
+
+    avr->data[addr] = v;
+    if (top < NUM_IDS) {
+	stats[top].excl += now - last;
+    }
+    last = now;
+
+    if (v == top) {
+	return;
+    }
+    if (depth > 1 && v == stack[depth-2].id) {
+	avr_cycle_count_t t = now - stack[depth-1].start;
+
+	if (top < NUM_IDS) {
+	    stats[top].incl += t;
+	    if (t > stats[top].max_incl) {
+		stats[top].max_incl = t;
+	    }
+	}
+	depth--;
+    } else if (depth < MAX_DEPTH) {
+	stack[depth].id = v;
+	stack[depth].start = now;
+	depth++;
+	if (v < NUM_IDS) {
+	    stats[v].count++;
+	}
+    } else {
+	overflows++;
+    }
+}
+
+/*
+ * Toggle the input at each half period of the square wave.
+ */
+static avr_cycle_count_t toggle(struct avr_t* avr, avr_cycle_count_t when,
+				void* param)
+{
+    level = !level;
+    avr_raise_irq(inputs[0], level);
+    if (inputs[1]) {
+	avr_raise_irq(inputs[1], level);
+    }
+    next_edge += half_period;
+    return (avr_cycle_count_t) next_edge;
+}
+
+static void report(avr_t* avr, double freq, avr_cycle_count_t cycles)
+{
+    double us = 1e6 / avr->frequency;
+    double seconds = (double) cycles / avr->frequency;
+    int i;
+
+    printf("\n%.6g Hz for %.3g s\n", freq, seconds);
+    printf("%-10s %9s %8s %10s %10s %8s\n", "routine", "count",
+	   "% excl", "mean incl", "max incl", "max us");
+    for (i = 1; i < NUM_IDS; i++) {
+	if (stats[i].count == 0) {
+	    continue;
+	}
+	printf("%-10s %9lu %8.3f %10.1f %10llu %8.1f\n",
+	       names[i] ? names[i] : "?", stats[i].count,
+	       100.0 * stats[i].excl / cycles,
+	       (double) stats[i].incl / stats[i].count,
+	       (unsigned long long) stats[i].max_incl,
+	       stats[i].max_incl * us);
+    }
+    printf("main loop busy: %.2f%% (%.2f%% with interrupts)\n",
+	   100.0 * stats[1].excl / cycles, 100.0 * stats[1].incl / cycles);
+    printf("display bytes: %lu (%.0f per second)\n", stats[5].count,
+	   stats[5].count / seconds);
+    if (overflows) {
+	printf("(%d writes ignored: nested too deep)\n", overflows);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    elf_firmware_t f;
+    avr_t* avr;
+    double seconds = 2;
+    int icp = 0;
+    int i;
+
+    while (argc > 1 && argv[1][0] == '-') {
+	if (strcmp(argv[1], "-icp") == 0) {
+	    icp = 1;
+	} else if (strcmp(argv[1], "-s") == 0 && argc > 2) {
+	    seconds = atof(argv[2]);
+	    argc--, argv++;
+	} else {
+	    break;
+	}
+	argc--, argv++;
+    }
+    if (argc < 3) {
+	fprintf(stderr, "usage: profile [-icp] [-s seconds] "
+		"main-profile.elf frequency...\n");
+	return 1;
+    }
+
+    memset(&f, 0, sizeof(f));
+    if (elf_read_firmware(argv[1], &f) != 0) {
+	fprintf(stderr, "%s: cannot read\n", argv[1]);
+	return 1;
+    }
+    avr = avr_make_mcu_by_name(f.mmcu);
+    if (!avr) {
+	fprintf(stderr, "%s: unknown mcu '%s'\n", argv[1], f.mmcu);
+	return 1;
+    }
+    avr_init(avr);
+    avr_load_firmware(avr, &f);
+
+    if (icp) {
+	inputs[0] = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('A'), 3);
+	avr_connect_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 2),
+			avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('A'), 7));
+    } else {
+	inputs[0] = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 2);
+	inputs[1] = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('A'), 4);
+    }
+    avr_raise_irq(inputs[0], level);
+    if (inputs[1]) {
+	avr_raise_irq(inputs[1], level);
+    }
+    avr_register_io_write(avr, GPIOR0_ADDR, gpior0_write, NULL);
+
+    for (i = 2; i < argc; i++) {
+	double freq = atof(argv[i]);
+	avr_cycle_count_t start = avr->cycle;
+	avr_cycle_count_t end = start +
+	    (avr_cycle_count_t) (seconds * avr->frequency);
+	int state = cpu_Running;
+
+	if (freq > avr->frequency / 4) {
+	    fprintf(stderr, "%s: at most %u Hz\n", argv[i],
+		    (unsigned) avr->frequency / 4);
+	    return 1;
+	}
+	avr_cycle_timer_cancel(avr, toggle, NULL);
+	if (freq > 0) {
+	    half_period = avr->frequency / freq / 2;
+	    next_edge = start + half_period;
+	    avr_cycle_timer_register(avr, (avr_cycle_count_t) half_period,
+				     toggle, NULL);
+	}
+	clear_stats(start);
+	while (avr->cycle < end &&
+	       state != cpu_Done && state != cpu_Crashed) {
+	    state = avr_run(avr);
+	}
+	report(avr, freq, avr->cycle - start);
+	if (state == cpu_Done || state == cpu_Crashed) {
+	    fprintf(stderr, "The program stopped\n");
+	    return 1;
+	}
+    }
+    avr_terminate(avr);
+    return 0;
+}
@@ -0,0 +1,15 @@
+/*
+ * The EEPROM, as provided by counter_test.c.
+ */
+#ifndef TEST_AVR_EEPROM_H
+#define TEST_AVR_EEPROM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EEMEM
+
+void eeprom_read_block(void* dst, const void* src, size_t n);
+void eeprom_update_block(const void* src, void* dst, size_t n);
+
+#endif
@@ -0,0 +1,134 @@
+/*
+ * The registers of the ATtiny84A that main.c uses, as plain variables
+ * for the host build (see counter_test.c, which defines them and
+ * plays the part of the hardware).
+ */
+#ifndef TEST_AVR_IO_H
+#define TEST_AVR_IO_H
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+#define REG8(name) extern volatile uint8_t name;
+#define REG16(name) extern volatile uint16_t name;
+
+REG8(PORTA) REG8(DDRA) REG8(PINA)
+REG8(PORTB) REG8(DDRB) REG8(PINB)
+REG8(TCCR0A) REG8(TCCR0B) REG8(TCNT0) REG8(OCR0A) REG8(OCR0B)
+REG8(TIMSK0) REG8(TIFR0)
+REG8(TCCR1A) REG8(TCCR1B) REG8(TCCR1C) REG16(TCNT1) REG16(OCR1A)
+REG16(OCR1B) REG16(ICR1) REG8(TIMSK1) REG8(TIFR1)
+REG8(MCUCR) REG8(GIMSK) REG8(GIFR) REG8(PCMSK0) REG8(PCMSK1)
+REG8(USICR) REG8(USISR) REG8(USIDR) REG8(USIBR)
+REG8(GPIOR0) REG8(GPIOR1) REG8(GPIOR2)
+REG8(ACSR) REG8(MCUSR) REG8(WDTCSR)
+
+#define PA0 0
+#define PA1 1
+#define PA2 2
+#define PA3 3
+#define PA4 4
+#define PA5 5
+#define PA6 6
+#define PA7 7
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+
+/* TCCR0A, TCCR0B */
+#define WGM00 0
+#define WGM01 1
+#define COM0B0 4
+#define COM0B1 5
+#define COM0A0 6
+#define COM0A1 7
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define WGM02 3
+#define FOC0B 6
+#define FOC0A 7
+
+/* TIMSK0, TIFR0 */
+#define TOIE0 0
+#define OCIE0A 1
+#define OCIE0B 2
+#define TOV0 0
+#define OCF0A 1
+#define OCF0B 2
+
+/* TCCR1A, TCCR1B, TCCR1C */
+#define WGM10 0
+#define WGM11 1
+#define COM1B0 4
+#define COM1B1 5
+#define COM1A0 6
+#define COM1A1 7
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define WGM12 3
+#define WGM13 4
+#define ICES1 6
+#define ICNC1 7
+#define FOC1B 6
+#define FOC1A 7
+
+/* TIMSK1, TIFR1 */
+#define TOIE1 0
+#define OCIE1A 1
+#define OCIE1B 2
+#define ICIE1 5
+#define TOV1 0
+#define OCF1A 1
+#define OCF1B 2
+#define ICF1 5
+
+/* MCUCR, GIMSK, GIFR */
+#define ISC00 0
+#define ISC01 1
+#define BODSE 2
+#define SM0 3
+#define SM1 4
+#define SE 5
+#define PUD 6
+#define BODS 7
+#define PCIE0 4
+#define PCIE1 5
+#define INT0 6
+#define PCIF0 4
+#define PCIF1 5
+#define INTF0 6
+
+/* PCMSK0, PCMSK1 */
+#define PCINT0 0
+#define PCINT1 1
+#define PCINT2 2
+#define PCINT3 3
+#define PCINT4 4
+#define PCINT5 5
+#define PCINT6 6
+#define PCINT7 7
+#define PCINT8 0
+#define PCINT9 1
+#define PCINT10 2
+#define PCINT11 3
+
+/* USICR, USISR */
+#define USITC 0
+#define USICLK 1
+#define USICS0 2
+#define USICS1 3
+#define USIWM0 4
+#define USIWM1 5
+#define USIOIE 6
+#define USISIE 7
+#define USIOIF 6
+
+/* ACSR, MCUSR */
+#define ACIC 2
+#define BORF 2
+
+#endif
@@ -0,0 +1,17 @@
+/*
+ * Sleeping is where the simulated time passes (see counter_test.c).
+ */
+#ifndef TEST_AVR_SLEEP_H
+#define TEST_AVR_SLEEP_H
+
+#define SLEEP_MODE_IDLE 0
+
+void sim_sleep(void);
+
+#define set_sleep_mode(mode) ((void) 0)
+#define sleep_enable() ((void) 0)
+#define sleep_disable() ((void) 0)
+#define sleep_cpu() sim_sleep()
+#define sleep_mode() sim_sleep()
+
+#endif
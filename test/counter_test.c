@@ -0,0 +1,751 @@
+/*
+ *    Frequency counter for ATTiny84A
+ *    Copyright (C) 2014  Bjorn Gustavsson
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Host test of the counting code ("make test").
+ *
+ * main.c is compiled for the host, against the registers in
+ * test/avr/io.h, and this program plays the part of the hardware: an
+ * input signal, timer 0 (the time keeping), timer 1 (counting the
+ * input on T1), INT0, and the interrupts. The whole program runs,
+ * including the main loop with its watchdog; the time passes while
+ * the main loop sleeps. The main loop takes no time, and an interrupt
+ * routine keeps the cpu for a fixed number of cycles, so the results
+ * show how the counting logic behaves, not the real interrupt latency
+ * (see "make profile-run" for that).
+ *
+ *    counter_test [-v] [name]
+ *
+ * runs the scenarios (those whose name starts with 'name'). Each one
+ * starts the program from reset with a gate profile and feeds it a
+ * sequence of segments of a square wave (or no signal), with some
+ * jitter on the edges. Every measurement that the program publishes
+ * is checked against the frequency of the segment it was taken in:
+ *
+ *    readings   Published measurements (excluding "no signal").
+ *    mixed      Measurements that span a change of the input. They
+ *               are not checked.
+ *    bad        Measurements within one segment that are more than
+ *               two ticks off, plus the jitter and ISR_CYCLES (an
+ *               end may wait for another interrupt routine).
+ *    err ppm    The largest error of the others that are at least as
+ *               long as the gate (the shorter ones are taken while
+ *               finding the number of events to count).
+ *    first ms   The longest time from the start of a segment to the
+ *               end of the first good measurement in it.
+ *    dead ms    The longest gap between the last good measurement in
+ *               one mode (slow or fast) and the first good one in the
+ *               other mode, when there is no pause in between.
+ *    lost ms    The longest time from the start of a pause to the
+ *               first "no signal" (a published one or the watchdog).
+ *
+ * A scenario fails if there is a bad measurement, or if a segment
+ * with a signal has no good measurement. -v prints each measurement.
+ */
+
+#include <math.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define main firmware_main
+#include "main-host.c"
+#undef main
+
+#if ENGINE_ICP
+#error "The test only models the default engine (ENGINE_ICP 0)"
+#endif
+
+volatile uint8_t PORTA, DDRA, PINA, PORTB, DDRB, PINB;
+volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, OCR0B, TIMSK0, TIFR0;
+volatile uint8_t TCCR1A, TCCR1B, TCCR1C, TIMSK1, TIFR1;
+volatile uint16_t TCNT1, OCR1A, OCR1B, ICR1;
+volatile uint8_t MCUCR, GIMSK, GIFR, PCMSK0, PCMSK1;
+volatile uint8_t USICR, USISR, USIDR, USIBR;
+volatile uint8_t GPIOR0, GPIOR1, GPIOR2;
+volatile uint8_t ACSR, MCUSR, WDTCSR;
+
+/*
+ * The interrupt flags. The flag registers are written with ones to
+ * clear flags, which a variable cannot do, so the real flags are kept
+ * here. Before the program runs, the registers are set to the flags
+ * plus FLAG_MARK (a bit that is not used); afterwards, a register
+ * without FLAG_MARK has been written, and a register with more bits
+ * has been written by "|=".
+ */
+#define FLAG_MARK 0x80
+static uint8_t gifr, tifr0, tifr1;
+
+/*
+ * The input signal: a sequence of segments of a square wave with
+ * 'freq' Hz, or no signal if 'freq' is 0. Each edge is moved by up
+ * to +/- 'jitter' seconds (uniformly distributed).
+ */
+struct segment {
+    double seconds;
+    double freq;
+    double jitter;
+};
+
+#define MAX_SEGMENTS 6
+
+struct scenario {
+    char name[48];
+    uint8_t gate;
+    uint8_t num_segments;
+    struct segment segments[MAX_SEGMENTS];
+};
+
+/* Simulated time in cpu cycles. */
+typedef unsigned long long cycle_t;
+
+static const struct scenario* sc;
+static int verbose;
+static cycle_t now;
+static cycle_t end;		/* End of the scenario */
+static jmp_buf done;
+
+/*
+ * An interrupt routine is taken to keep the cpu this long; no other
+ * interrupt is taken until it is done. (Appr. the cycles of the
+ * routines for the slow and fast mode, see "make profile-run".)
+ */
+#define ISR_CYCLES 100
+static cycle_t busy_until;
+
+static uint8_t seg;		/* Current segment */
+static cycle_t seg_start[MAX_SEGMENTS+1];
+static double period;		/* Of the signal, in cycles */
+static double jitter;		/* In cycles */
+static unsigned long long edge_index;
+static double next_edge;	/* Time of the next edge, or -1 */
+static uint8_t level = 1;	/* Of the input */
+static unsigned long random_state = 1;
+
+/* What was published. */
+static uint8_t seen_head;
+static struct counter volatile* seen_current;
+static unsigned long readings;
+static unsigned long mixed;
+static unsigned long bad;
+static double max_err_ppm;
+static cycle_t first_good[MAX_SEGMENTS];
+static cycle_t first_lost[MAX_SEGMENTS];
+static int8_t last_mode = -1;
+static cycle_t last_end;
+static double max_dead = -1;	/* None yet */
+
+static struct config eeprom_image;
+
+void eeprom_read_block(void* dst, const void* src, size_t n)
+{
+    memcpy(dst, &eeprom_image, n);
+}
+
+void eeprom_update_block(const void* src, void* dst, size_t n)
+{
+}
+
+/*
+ * A valid configuration with gate profile 'gate'.
+ */
+static void eeprom_init(uint8_t gate)
+{
+    uint8_t* p = (uint8_t*) &eeprom_image;
+    uint8_t sum = 0;
+    size_t i;
+
+    memset(&eeprom_image, 0, sizeof(eeprom_image));
+    eeprom_image.version = CONFIG_VERSION;
+    eeprom_image.gate = gate;
+    eeprom_image.contrast = DOG_LCD_CONTRAST;
+    eeprom_image.prescaler = INPUT_PRESCALER;
+    for (i = 0; i < sizeof(eeprom_image); i++) {
+	sum += p[i];
+    }
+    eeprom_image.checksum = -sum;
+}
+
+static double to_ms(cycle_t c)
+{
+    return c * 1000.0 / F_CPU;
+}
+
+/*
+ * Uniformly distributed between -1 and 1.
+ */
+static double random_unit(void)
+{
+    random_state = random_state * 1103515245UL + 12345;
+    return ((random_state >> 8) & 0xffff) / 32767.5 - 1;
+}
+
+/*
+ * Edges alternate, first falling, from the start of the segment.
+ */
+static void edge_schedule(void)
+{
+    double t = seg_start[seg] + (edge_index + 1) * period / 2;
+
+    if (jitter) {
+	t += jitter * random_unit();
+    }
+    next_edge = t;
+}
+
+static void segment_start(void)
+{
+    const struct segment* s = &sc->segments[seg];
+
+    edge_index = 0;
+    next_edge = -1;
+    if (s->freq > 0) {
+	period = F_CPU / s->freq;
+	jitter = s->jitter * F_CPU;
+	level = 1;
+	edge_schedule();
+    }
+}
+
+/*
+ * The state of the pins, as seen by the program.
+ */
+static void pins_update(void)
+{
+    PINA = _BV(PA6) | (level ? _BV(PA4) : 0); /* Button not pressed */
+    PINB = level ? _BV(PB2) : 0;
+}
+
+static void before_program(void)
+{
+    pins_update();
+    GIFR = gifr | FLAG_MARK;
+    TIFR0 = tifr0 | FLAG_MARK;
+    TIFR1 = tifr1 | FLAG_MARK;
+}
+
+static void flags_written(volatile uint8_t* reg, uint8_t* flags)
+{
+    uint8_t v = *reg;
+
+    if ((v & FLAG_MARK) == 0) {
+	*flags &= ~v;
+    } else if (v != (*flags | FLAG_MARK)) {
+	*flags &= ~v;
+    }
+}
+
+static void after_program(void)
+{
+    flags_written(&GIFR, &gifr);
+    flags_written(&TIFR0, &tifr0);
+    flags_written(&TIFR1, &tifr1);
+}
+
+/*
+ * Return the index of the segment that 'c' is in.
+ */
+static uint8_t segment_at(cycle_t c)
+{
+    uint8_t i = 0;
+
+    while (i + 1 < sc->num_segments && c >= seg_start[i+1]) {
+	i++;
+    }
+    return i;
+}
+
+/*
+ * Return true if there is a pause in the input between 'a' and 'b'.
+ */
+static int pause_between(cycle_t a, cycle_t b)
+{
+    uint8_t i;
+
+    for (i = segment_at(a); i <= segment_at(b); i++) {
+	if (sc->segments[i].freq == 0) {
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+static void note_lost(cycle_t c)
+{
+    uint8_t i = segment_at(c);
+
+    if (sc->segments[i].freq == 0 && first_lost[i] == 0) {
+	first_lost[i] = c - seg_start[i] + 1;
+    }
+}
+
+/*
+ * Check a measurement that was just published.
+ */
+static void check(volatile struct measurement* m)
+{
+    double ticks = m->period;
+    double events = (double) (1UL << m->log2num_events);
+    cycle_t c_end = (cycle_t) m->end_ticks * TICK_PRESCALER;
+    cycle_t c_start;
+    cycle_t margin = 2 * TICK_PRESCALER;
+    uint8_t i;
+    const char* verdict = "ok";
+    double err = 0;
+    int8_t mode;
+
+    if (m->period == MAX_PERIOD) {
+	if (verbose) {
+	    printf("  %10.3f ms  no signal\n", to_ms(now));
+	}
+	note_lost(now);
+	return;
+    }
+#if REGRESSION
+    if (m->mode == MODE_REGRESSION) {
+	ticks /= REG_GAIN;
+    }
+#endif
+    readings++;
+    c_start = c_end - (cycle_t) (ticks * TICK_PRESCALER);
+
+    /*
+     * The ends are only known to a tick or so, and the edges may be
+     * moved by the jitter; a measurement that has an end that close
+     * to a change of the input is not counted as within the segment.
+     */
+    i = segment_at(c_start);
+    margin += (cycle_t) (sc->segments[i].jitter * F_CPU);
+    if (c_start > c_end || sc->segments[i].freq == 0 ||
+	c_start < seg_start[i] + margin || c_end + margin >= seg_start[i+1]) {
+	mixed++;
+	verdict = "mixed";
+    } else {
+	double f = sc->segments[i].freq;
+	double ideal = events * TICK_HZ / f;
+	double limit = 2 + 2 * sc->segments[i].jitter * TICK_HZ +
+	    (double) ISR_CYCLES / TICK_PRESCALER;
+
+	err = ticks - ideal;
+	if (fabs(err) > limit) {
+	    bad++;
+	    verdict = "BAD";
+	} else {
+	    if (ideal >= gates[sc->gate].min_period &&
+		fabs(err) / ideal * 1e6 > max_err_ppm) {
+		max_err_ppm = fabs(err) / ideal * 1e6;
+	    }
+	    if (first_good[i] == 0) {
+		first_good[i] = c_end - seg_start[i] + 1;
+	    }
+
+	    /* A pause in between is not dead time. */
+	    mode = m->mode == MODE_SLOW ? MODE_SLOW : MODE_FAST;
+	    if (last_mode >= 0 && mode != last_mode && c_start > last_end &&
+		!pause_between(last_end, c_start)) {
+		double dead = to_ms(c_start - last_end);
+
+		if (dead > max_dead) {
+		    max_dead = dead;
+		}
+	    }
+	    last_mode = mode;
+	    last_end = c_end;
+	}
+    }
+    if (verbose) {
+	printf("  %10.3f ms  mode %u  2^%-2u events  %10.1f ticks  "
+	       "%+8.2f  %s\n", to_ms(c_end), m->mode, m->log2num_events,
+	       ticks, err, verdict);
+    }
+}
+
+/*
+ * Look at what the program has done since the last time.
+ */
+static void observe(int in_main)
+{
+    while (seen_head != meas_head) {
+	check(&meas_ring[seen_head]);
+	seen_head = (seen_head + 1) & (MEAS_RING_SIZE-1);
+    }
+    if (in_main && seen_current == &fast_cnt && current == &slow_cnt) {
+	if (verbose) {
+	    printf("  %10.3f ms  watchdog\n", to_ms(now));
+	}
+	note_lost(now);
+    }
+    seen_current = current;
+}
+
+static void run_isr(void (*isr)(void))
+{
+    before_program();
+    isr();
+    after_program();
+    observe(0);
+}
+
+/*
+ * Run the interrupt routine of the pending interrupt that comes first
+ * in the vector table. Return 0 if there is none.
+ */
+static int interrupt(void)
+{
+    if (gifr & GIMSK & _BV(INTF0)) {
+	gifr &= ~_BV(INTF0);
+	run_isr(EXT_INT0_vect);
+    } else if (tifr1 & TIMSK1 & _BV(OCF1A)) {
+	tifr1 &= ~_BV(OCF1A);
+	run_isr(TIM1_COMPA_vect);
+#if defined(TOTAL_vect) && TOTAL_BITS == 16
+    } else if (tifr1 & TIMSK1 & _BV(TOV1)) {
+	tifr1 &= ~_BV(TOV1);
+	run_isr(TOTAL_vect);
+#endif
+    } else if (tifr0 & TIMSK0 & _BV(OCF0A)) {
+	tifr0 &= ~_BV(OCF0A);
+	run_isr(DOG_vect);
+#if SERIAL
+    } else if (tifr0 & TIMSK0 & _BV(OCF0B)) {
+	tifr0 &= ~_BV(OCF0B);
+	run_isr(SERIAL_vect);
+#endif
+    } else if (tifr0 & TIMSK0 & _BV(TOV0)) {
+	tifr0 &= ~_BV(TOV0);
+	run_isr(TIM0_OVF_vect);
+    } else {
+	return 0;
+    }
+    busy_until = now + ISR_CYCLES;
+    return 1;
+}
+
+/*
+ * Return the division factor of timer 0, or 0 if it is stopped.
+ */
+static unsigned timer0_prescaler(void)
+{
+    static const unsigned factors[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+
+    return factors[TCCR0B & 7];
+}
+
+/*
+ * One clock of timer 0, in normal mode.
+ */
+static void timer0_clock(void)
+{
+    uint8_t old = TCNT0;
+
+    if (old == OCR0A) {
+	tifr0 |= _BV(OCF0A);
+    }
+    if (old == OCR0B) {
+	tifr0 |= _BV(OCF0B);
+    }
+    TCNT0 = old + 1;
+    if (old == 0xff) {
+	tifr0 |= _BV(TOV0);
+    }
+}
+
+/*
+ * One clock of timer 1, from T1, in normal or CTC mode.
+ */
+static void timer1_clock(void)
+{
+    uint16_t top = TCCR1B & _BV(WGM12) ? OCR1A : 0xffff;
+    uint16_t old = TCNT1;
+
+    if (old == OCR1A) {
+	tifr1 |= _BV(OCF1A);
+    }
+    if (old == OCR1B) {
+	tifr1 |= _BV(OCF1B);
+    }
+    if (old == top) {
+	TCNT1 = 0;
+	if (top == 0xffff) {
+	    tifr1 |= _BV(TOV1);
+	}
+    } else {
+	TCNT1 = old + 1;
+    }
+}
+
+static void input_edge(void)
+{
+    uint8_t cs1 = TCCR1B & 7;
+    uint8_t isc = MCUCR & 3;
+
+    level = !level;
+    if (cs1 == (level ? 7 : 6)) {
+	timer1_clock();
+    }
+    if (isc == 1 || isc == (level ? 3 : 2)) {
+	gifr |= _BV(INTF0);
+    }
+    edge_index++;
+    edge_schedule();
+}
+
+/*
+ * The main loop has gone to sleep. Let the time pass until an
+ * interrupt wakes it up.
+ */
+void sim_sleep(void)
+{
+    after_program();
+    observe(1);
+    for (;;) {
+	unsigned p = timer0_prescaler();
+	cycle_t t = end;
+	cycle_t tick = p ? (now / p + 1) * p : end;
+	cycle_t edge = next_edge >= 0 ? (cycle_t) ceil(next_edge) : end;
+	cycle_t next_seg = seg_start[seg+1];
+
+	if (now >= busy_until && interrupt()) {
+	    break;
+	}
+	if (edge <= now) {
+	    edge = now + 1;
+	}
+	if (tick < t) {
+	    t = tick;
+	}
+	if (edge < t) {
+	    t = edge;
+	}
+	if (next_seg < t) {
+	    t = next_seg;
+	}
+	if (busy_until > now && busy_until < t) {
+	    t = busy_until;
+	}
+	if (t >= end) {
+	    now = end;
+	    longjmp(done, 1);
+	}
+	now = t;
+	if (now == next_seg) {
+	    seg++;
+	    segment_start();
+	    continue;
+	}
+	if (now == edge) {
+	    input_edge();
+	}
+	if (now == tick) {
+	    timer0_clock();
+	}
+    }
+    before_program();
+}
+
+/*
+ * Print a time, or "-" if it is negative (nothing has happened).
+ */
+static void print_ms(double ms)
+{
+    if (ms < 0) {
+	printf(" %8s", "-");
+    } else {
+	printf(" %8.1f", ms);
+    }
+}
+
+/*
+ * Run one scenario from reset. Return 0 if it passed.
+ */
+static int run(const struct scenario* s)
+{
+    cycle_t c = 0;
+    double first = 0;
+    double lost = -1;
+    int failed;
+    uint8_t i;
+
+    sc = s;
+    for (i = 0; i < s->num_segments; i++) {
+	seg_start[i] = c;
+	c += (cycle_t) (s->segments[i].seconds * F_CPU);
+    }
+    seg_start[i] = end = c;
+    seg = 0;
+    segment_start();
+    eeprom_init(s->gate);
+    seen_current = current;
+
+    if (verbose) {
+	printf("%s\n", s->name);
+    }
+    if (setjmp(done) == 0) {
+	before_program();
+	firmware_main();
+    }
+
+    failed = bad != 0;
+    for (i = 0; i < s->num_segments; i++) {
+	if (s->segments[i].freq == 0) {
+	    if (first_lost[i] && to_ms(first_lost[i]) > lost) {
+		lost = to_ms(first_lost[i]);
+	    }
+	} else if (first_good[i] == 0) {
+	    failed = 1;
+	} else if (to_ms(first_good[i]) > first) {
+	    first = to_ms(first_good[i]);
+	}
+    }
+    printf("%-30s %8lu %6lu %4lu %9.2f %9.1f", s->name, readings, mixed,
+	   bad, max_err_ppm, first);
+    print_ms(max_dead);
+    print_ms(lost);
+    printf("  %s\n", failed ? "FAIL" : "ok");
+    return failed;
+}
+
+#define NUM_SCENARIOS 64
+static struct scenario scenarios[NUM_SCENARIOS];
+static int num_scenarios;
+
+static struct scenario* scenario_add(const char* name, uint8_t gate)
+{
+    struct scenario* s = &scenarios[num_scenarios];
+
+    if (num_scenarios == NUM_SCENARIOS ||
+	snprintf(s->name, sizeof(s->name), "%s %s", name,
+		 gates[gate].name) >= (int) sizeof(s->name)) {
+	fprintf(stderr, "%s: too many scenarios or too long name\n", name);
+	exit(1);
+    }
+    num_scenarios++;
+    s->gate = gate;
+    return s;
+}
+
+static void segment_add(struct scenario* s, double seconds, double freq,
+			double jitter)
+{
+    struct segment* g = &s->segments[s->num_segments++];
+
+    g->seconds = seconds;
+    g->freq = freq;
+    g->jitter = jitter;
+}
+
+static void scenarios_init(void)
+{
+    static const double sweep[] = {
+	0.5, 2, 15, 25, 40, 130, 1e3, 1e4, 1e5, 1e6, 5e6,
+    };
+    struct scenario* s;
+    char name[32];
+    uint8_t g;
+    unsigned i;
+
+    /* Sweep: each frequency from reset. */
+    for (g = 0; g < NUM_GATES; g++) {
+	for (i = 0; i < sizeof(sweep) / sizeof(sweep[0]); i++) {
+	    snprintf(name, sizeof(name), "sweep %gHz", sweep[i]);
+	    s = scenario_add(name, g);
+	    segment_add(s, 4 + 4 / sweep[i] + 3 * g * g, sweep[i], 0);
+	}
+    }
+
+    /* Steps between slow and fast mode, and within fast mode. */
+    for (g = 0; g < NUM_GATES; g++) {
+	s = scenario_add("step 1Hz-1MHz-1Hz", g);
+	segment_add(s, 8, 1, 0);
+	segment_add(s, 4 + 3 * g, 1e6, 0);
+	segment_add(s, 8 + 3 * g, 1, 0);
+	s = scenario_add("step 100kHz-100Hz-100kHz", g);
+	segment_add(s, 4 + 3 * g, 1e5, 0);
+	segment_add(s, 4 + 3 * g, 100, 0);
+	segment_add(s, 4 + 3 * g, 1e5, 0);
+    }
+
+    /* Jitter on the edges. */
+    s = scenario_add("jitter 10Hz 50us", GATE_DEFAULT);
+    segment_add(s, 6, 10, 50e-6);
+    s = scenario_add("jitter 1kHz 1us", GATE_DEFAULT);
+    segment_add(s, 4, 1e3, 1e-6);
+    s = scenario_add("jitter 100kHz 100ns", GATE_DEFAULT);
+    segment_add(s, 4, 1e5, 100e-9);
+
+    /* Pauses in the signal. */
+    for (g = 0; g < NUM_GATES; g++) {
+	s = scenario_add("dropout 1kHz 0.3s 8s", g);
+	segment_add(s, 4 + 3 * g, 1e3, 0);
+	segment_add(s, 0.3, 0, 0);
+	segment_add(s, 4 + 3 * g, 1e3, 0);
+	segment_add(s, 8, 0, 0);
+	segment_add(s, 4 + 3 * g, 1e3, 0);
+    }
+    s = scenario_add("dropout 10Hz 2s", GATE_DEFAULT);
+    segment_add(s, 5, 10, 0);
+    segment_add(s, 2, 0, 0);
+    segment_add(s, 5, 10, 0);
+}
+
+int main(int argc, char** argv)
+{
+    const char* only = "";
+    int failed = 0;
+    int n = 0;
+    int i;
+
+    if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+	verbose = 1;
+	argc--, argv++;
+    }
+    if (argc > 1) {
+	only = argv[1];
+    }
+
+    scenarios_init();
+    printf("%-30s %8s %6s %4s %9s %9s %8s %8s\n", "scenario", "readings",
+	   "mixed", "bad", "err ppm", "first ms", "dead ms", "lost ms");
+    for (i = 0; i < num_scenarios; i++) {
+	pid_t pid;
+	int status;
+
+	if (strncmp(scenarios[i].name, only, strlen(only)) != 0) {
+	    continue;
+	}
+	n++;
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0) {
+	    exit(run(&scenarios[i]));
+	}
+	if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+	    if (pid < 0 || !WIFEXITED(status)) {
+		printf("%-30s crashed\n", scenarios[i].name);
+	    }
+	    failed++;
+	}
+    }
+    printf("%d of %d scenarios failed\n", failed, n);
+    return failed != 0;
+}
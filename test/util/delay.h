@@ -0,0 +1,10 @@
+/*
+ * Busy waits take no simulated time.
+ */
+#ifndef TEST_UTIL_DELAY_H
+#define TEST_UTIL_DELAY_H
+
+#define _delay_us(us) ((void) 0)
+#define _delay_ms(ms) ((void) 0)
+
+#endif